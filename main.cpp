@@ -2,7 +2,34 @@
 #include <filesystem>
 #include <fstream>
 #include <sstream>
+#include <iomanip>
 #include <unordered_map>
+#include <map>
+#include <array>
+#include <queue>
+#include <unordered_set>
+#include <list>
+#include <deque>
+#include <mutex>
+#include <condition_variable>
+#include <functional>
+#include <future>
+#include <thread>
+#include <atomic>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/sysmacros.h>
+#include <dirent.h>
+#include <sys/inotify.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <poll.h>
+#include <csignal>
+#include <fcntl.h>
+#include <cstring>
+#include <algorithm>
+#include <string_view>
 #include <openssl/sha.h>
 #include "zstr.hpp"
 
@@ -11,12 +38,121 @@
 using namespace std;
 using namespace filesystem;
 
+// "00".."ff" for every byte value, and the value of every hex digit (-1 otherwise)
+struct HexTables
+{
+    char pairs[256][2];
+    signed char digits[256];
+
+    HexTables()
+    {
+        const char *alphabet = "0123456789abcdef";
+        for (int i = 0; i < 256; i++)
+        {
+            pairs[i][0] = alphabet[i >> 4];
+            pairs[i][1] = alphabet[i & 15];
+            digits[i] = -1;
+        }
+        for (int i = 0; i < 16; i++)
+        {
+            digits[static_cast<unsigned char>(alphabet[i])] = i;
+            digits[static_cast<unsigned char>(toupper(alphabet[i]))] = i;
+        }
+    }
+};
+
+const HexTables hexTables;
+
+// A 20-byte binary object id. The all-zero id doubles as "no object".
+struct ObjectId
+{
+    unsigned char hash[SHA_DIGEST_LENGTH] = {};
+
+    static ObjectId fromRaw(const void *raw)
+    {
+        ObjectId id;
+        memcpy(id.hash, raw, SHA_DIGEST_LENGTH);
+        return id;
+    }
+
+    static bool fromHex(string_view hexSha, ObjectId &id)
+    {
+        if (hexSha.size() != 2 * SHA_DIGEST_LENGTH)
+            return false;
+
+        // OR-ing the digit values together leaves the sign bit set if any was invalid
+        signed char invalid = 0;
+        for (int i = 0; i < SHA_DIGEST_LENGTH; i++)
+        {
+            signed char high = hexTables.digits[static_cast<unsigned char>(hexSha[2 * i])];
+            signed char low = hexTables.digits[static_cast<unsigned char>(hexSha[2 * i + 1])];
+            invalid |= high | low;
+            id.hash[i] = (high << 4) | low;
+        }
+        return invalid >= 0;
+    }
+
+    // Parses hexSha, giving the null id if it is not a valid id
+    static ObjectId parse(string_view hexSha)
+    {
+        ObjectId id;
+        if (!fromHex(hexSha, id))
+            return ObjectId();
+        return id;
+    }
+
+    string toHex() const
+    {
+        string hexSha(2 * SHA_DIGEST_LENGTH, '\0');
+        for (int i = 0; i < SHA_DIGEST_LENGTH; i++)
+            memcpy(&hexSha[2 * i], hexTables.pairs[hash[i]], 2);
+        return hexSha;
+    }
+
+    bool isNull() const
+    {
+        static const unsigned char zero[SHA_DIGEST_LENGTH] = {};
+        return memcmp(hash, zero, SHA_DIGEST_LENGTH) == 0;
+    }
+
+    bool operator==(const ObjectId &other) const
+    {
+        return memcmp(hash, other.hash, SHA_DIGEST_LENGTH) == 0;
+    }
+
+    bool operator!=(const ObjectId &other) const
+    {
+        return !(*this == other);
+    }
+
+    bool operator<(const ObjectId &other) const
+    {
+        return memcmp(hash, other.hash, SHA_DIGEST_LENGTH) < 0;
+    }
+};
+
+// Ids are already uniformly distributed, so their first bytes make a good hash
+struct ObjectIdHash
+{
+    size_t operator()(const ObjectId &id) const
+    {
+        size_t value;
+        memcpy(&value, id.hash, sizeof(value));
+        return value;
+    }
+};
+
+ostream &operator<<(ostream &out, const ObjectId &id)
+{
+    return out << id.toHex();
+}
+
 struct TreeEntry
 {
     string filemod;
     string filename;
     string filetype;
-    string filehash;
+    ObjectId filehash;
 };
 
 struct User
@@ -29,10 +165,190 @@ User user = {"aarathib", "aarathy00@gmail.com"};
 
 struct Metadata
 {
-    string sha;
-    string filemod;
+    string_view path;
+    ObjectId sha;
+    uint32_t mode = 0100644;
+    bool removed = false;
+    // stat data from when the entry was hashed, all zero if unknown
+    int64_t ctimeSec = 0;
+    int64_t ctimeNsec = 0;
+    int64_t mtimeSec = 0;
+    int64_t mtimeNsec = 0;
+    uint64_t dev = 0;
+    uint64_t ino = 0;
+    uint64_t size = 0;
+};
+
+// Work-stealing pool: every worker owns a deque, pops its own tasks LIFO and
+// steals from the front of the others when it runs dry. Threads blocked in
+// wait() keep executing queued tasks, so tasks may wait on their own subtasks.
+class ThreadPool
+{
+public:
+    explicit ThreadPool(unsigned int threads)
+    {
+        if (threads == 0)
+            threads = 1;
+        // The calling thread helps out in wait(), so it counts as one worker
+        for (unsigned int i = 0; i < threads; i++)
+            queues.push_back(make_unique<TaskQueue>());
+        for (unsigned int i = 1; i < threads; i++)
+            workers.emplace_back([this, i]
+                                 { workerLoop(i); });
+    }
+
+    ~ThreadPool()
+    {
+        {
+            lock_guard<mutex> lock(sleepLock);
+            stopping = true;
+        }
+        sleepCond.notify_all();
+        for (thread &worker : workers)
+            worker.join();
+    }
+
+    template <class F>
+    auto submit(F task) -> future<decltype(task())>
+    {
+        using Result = decltype(task());
+        auto packaged = make_shared<packaged_task<Result()>>(move(task));
+        future<Result> result = packaged->get_future();
+        if (workers.empty())
+        {
+            (*packaged)();
+            return result;
+        }
+
+        size_t target = (queueIndex != SIZE_MAX) ? queueIndex : nextQueue++ % queues.size();
+        pending++;
+        {
+            lock_guard<mutex> lock(queues[target]->lock);
+            queues[target]->tasks.emplace_back([packaged]
+                                               { (*packaged)(); });
+        }
+        {
+            lock_guard<mutex> lock(sleepLock);
+        }
+        sleepCond.notify_one();
+        return result;
+    }
+
+    template <class T>
+    T wait(future<T> &result)
+    {
+        size_t self = (queueIndex != SIZE_MAX) ? queueIndex : 0;
+        while (result.wait_for(chrono::seconds(0)) != future_status::ready)
+        {
+            if (!runOne(self))
+                result.wait_for(chrono::microseconds(100));
+        }
+        return result.get();
+    }
+
+private:
+    struct TaskQueue
+    {
+        mutex lock;
+        deque<function<void()>> tasks;
+    };
+
+    vector<unique_ptr<TaskQueue>> queues;
+    vector<thread> workers;
+    atomic<size_t> pending{0};
+    atomic<size_t> nextQueue{0};
+    mutex sleepLock;
+    condition_variable sleepCond;
+    bool stopping = false;
+    static thread_local size_t queueIndex;
+
+    bool runOne(size_t self)
+    {
+        function<void()> task;
+        {
+            lock_guard<mutex> lock(queues[self]->lock);
+            if (!queues[self]->tasks.empty())
+            {
+                task = move(queues[self]->tasks.back());
+                queues[self]->tasks.pop_back();
+            }
+        }
+        for (size_t i = 1; !task && i < queues.size(); i++)
+        {
+            TaskQueue &victim = *queues[(self + i) % queues.size()];
+            lock_guard<mutex> lock(victim.lock);
+            if (!victim.tasks.empty())
+            {
+                task = move(victim.tasks.front());
+                victim.tasks.pop_front();
+            }
+        }
+        if (!task)
+            return false;
+
+        pending--;
+        task();
+        return true;
+    }
+
+    void workerLoop(size_t self)
+    {
+        queueIndex = self;
+        while (true)
+        {
+            if (runOne(self))
+                continue;
+
+            unique_lock<mutex> lock(sleepLock);
+            sleepCond.wait(lock, [this]
+                           { return stopping || pending > 0; });
+            if (stopping && pending == 0)
+                return;
+        }
+    }
 };
 
+thread_local size_t ThreadPool::queueIndex = SIZE_MAX;
+
+// Number of threads used for hashing and compression, 0 means "not set"
+unsigned int jobs = 0;
+
+// Set by --debug: tree parsing and commit print what they read to stderr
+bool debugTrace = false;
+
+string readConfig(const string &key)
+{
+    ifstream configFile(".mygit/config");
+    string line;
+    while (getline(configFile, line))
+    {
+        size_t eq = line.find('=');
+        if (eq == string::npos)
+            continue;
+
+        string name = line.substr(0, eq);
+        string value = line.substr(eq + 1);
+        name.erase(0, name.find_first_not_of(" \t"));
+        name.erase(name.find_last_not_of(" \t") + 1);
+        value.erase(0, value.find_first_not_of(" \t"));
+        value.erase(value.find_last_not_of(" \t") + 1);
+        if (name == key)
+            return value;
+    }
+    return "";
+}
+
+ThreadPool &workPool()
+{
+    if (jobs == 0)
+    {
+        string configured = readConfig("core.threads");
+        jobs = configured.empty() ? thread::hardware_concurrency() : strtoul(configured.c_str(), nullptr, 10);
+    }
+    static ThreadPool pool(jobs);
+    return pool;
+}
+
 vector<char> compressData(const string &data)
 {
     vector<char> compressedData(compressBound(data.size()));
@@ -48,885 +364,6608 @@ vector<char> compressData(const string &data)
     return compressedData;
 }
 
-string hashObject(string filepath, bool create_blob, bool printsha = false)
+void putBigEndian(string &data, uint64_t value, int width)
 {
-    SHA_CTX shaContext;
-    SHA1_Init(&shaContext);
+    for (int shift = 8 * (width - 1); shift >= 0; shift -= 8)
+        data.push_back(static_cast<char>(value >> shift));
+}
 
-    ifstream ipStream(filepath, ios::binary);
-    if (!ipStream)
+uint64_t getBigEndian(const char *data, int width)
+{
+    uint64_t value = 0;
+    for (int i = 0; i < width; i++)
+        value = (value << 8) | static_cast<unsigned char>(data[i]);
+    return value;
+}
+
+#define PACK_SIGNATURE "PACK"
+#define PACK_VERSION 2
+#define PACK_IDX_SIGNATURE "\377tOc"
+#define PACK_IDX_VERSION 2
+// signature, version, 256 fanout counts
+#define PACK_IDX_HEADER (4 + 4 + 256 * 4)
+
+enum PackObjectType
+{
+    OBJ_NONE = 0,
+    OBJ_COMMIT = 1,
+    OBJ_TREE = 2,
+    OBJ_BLOB = 3,
+    OBJ_TAG = 4,
+    // content is a delta against the object whose 20-byte id precedes the zlib data
+    OBJ_REF_DELTA = 7,
+};
+
+string packTypeName(int type)
+{
+    switch (type)
     {
-        cerr << "Err: Cannot open file " << filepath << "\n";
-        return "";
+    case OBJ_COMMIT:
+        return "commit";
+    case OBJ_TREE:
+        return "tree";
+    case OBJ_BLOB:
+        return "blob";
+    case OBJ_TAG:
+        return "tag";
     }
+    return "";
+}
 
-    ipStream.seekg(0, ios::end);
-    size_t filesize = ipStream.tellg();
-    ipStream.seekg(0, ios::beg);
-    string header = "blob " + to_string(filesize) + '\0';
-    SHA1_Update(&shaContext, header.c_str(), header.size());
+int packTypeCode(const string &type)
+{
+    if (type == "commit")
+        return OBJ_COMMIT;
+    if (type == "tree")
+        return OBJ_TREE;
+    if (type == "blob")
+        return OBJ_BLOB;
+    if (type == "tag")
+        return OBJ_TAG;
+    return OBJ_NONE;
+}
 
-    char buffer[BUFFER_SIZE];
-    while (true)
+// A packfile and its index, both mapped read-only.
+// pack-<id>.pack: "PACK", version, object count, then per object a git-style
+// type/size varint followed by the zlib stream of its content (for deltas: the
+// base id, then the zlib stream of the delta), then a SHA-1 of everything
+// before it.
+// pack-<id>.idx: "\377tOc", version, a 256-entry fanout of cumulative counts by
+// first id byte, the sorted 20-byte ids, one 8-byte pack offset per id, then
+// the pack checksum.
+struct Pack
+{
+    string packPath;
+    const char *idx = nullptr;
+    size_t idxSize = 0;
+    const char *data = nullptr;
+    size_t dataSize = 0;
+    uint32_t count = 0;
+
+    ObjectId idAt(uint32_t pos) const
     {
-        ipStream.read(buffer, BUFFER_SIZE);
-        streamsize bytesRead = ipStream.gcount();
-        if (bytesRead == 0)
-            break;
+        return ObjectId::fromRaw(idx + PACK_IDX_HEADER + pos * SHA_DIGEST_LENGTH);
+    }
 
-        SHA1_Update(&shaContext, buffer, bytesRead);
+    uint64_t offsetAt(uint32_t pos) const
+    {
+        return getBigEndian(idx + PACK_IDX_HEADER + count * SHA_DIGEST_LENGTH + pos * 8, 8);
     }
 
-    unsigned char hash[SHA_DIGEST_LENGTH];
-    SHA1_Final(hash, &shaContext);
-    stringstream ss;
-    for (int i = 0; i < SHA_DIGEST_LENGTH; i++)
+    bool find(const ObjectId &id, uint64_t &offset) const
     {
-        ss << hex << setw(2) << setfill('0') << static_cast<int>(hash[i]);
+        uint32_t lo = id.hash[0] == 0 ? 0 : getBigEndian(idx + 8 + (id.hash[0] - 1) * 4, 4);
+        uint32_t hi = getBigEndian(idx + 8 + id.hash[0] * 4, 4);
+        while (lo < hi)
+        {
+            uint32_t mid = lo + (hi - lo) / 2;
+            int cmp = memcmp(idx + PACK_IDX_HEADER + mid * SHA_DIGEST_LENGTH, id.hash, SHA_DIGEST_LENGTH);
+            if (cmp == 0)
+            {
+                offset = offsetAt(mid);
+                return true;
+            }
+            if (cmp < 0)
+                lo = mid + 1;
+            else
+                hi = mid;
+        }
+        return false;
     }
-    string sha = ss.str();
-    if (printsha)
-        cout << "sha1 " << sha << '\n';
+};
+
+const char *mapFile(const string &filepath, size_t &size)
+{
+    int fd = open(filepath.c_str(), O_RDONLY);
+    if (fd < 0)
+        return nullptr;
+
+    struct stat st;
+    void *data = MAP_FAILED;
+    if (fstat(fd, &st) == 0 && st.st_size > 0)
+        data = mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (data == MAP_FAILED)
+        return nullptr;
+
+    size = st.st_size;
+    return static_cast<const char *>(data);
+}
+
+// Whether the last SHA_DIGEST_LENGTH bytes of data are the SHA-1 of the rest
+bool hasValidChecksum(const char *data, size_t size)
+{
+    if (size < SHA_DIGEST_LENGTH)
+        return false;
+    unsigned char checksum[SHA_DIGEST_LENGTH];
+    SHA1(reinterpret_cast<const unsigned char *>(data), size - SHA_DIGEST_LENGTH, checksum);
+    return memcmp(checksum, data + size - SHA_DIGEST_LENGTH, SHA_DIGEST_LENGTH) == 0;
+}
 
-    if (create_blob)
+// Checks that a pack and its index are laid out as described at Pack and agree
+// with each other, so that lookups stay inside both mappings
+string checkPackLayout(const Pack &pack)
+{
+    if (pack.idxSize < PACK_IDX_HEADER || memcmp(pack.idx, PACK_IDX_SIGNATURE, 4) != 0 ||
+        getBigEndian(pack.idx + 4, 4) != PACK_IDX_VERSION)
+        return "bad index header";
+    if (pack.idxSize != PACK_IDX_HEADER + static_cast<size_t>(pack.count) * (SHA_DIGEST_LENGTH + 8) + SHA_DIGEST_LENGTH)
+        return "index has the wrong size";
+    for (int i = 1; i < 256; i++)
+    {
+        if (getBigEndian(pack.idx + 8 + i * 4, 4) < getBigEndian(pack.idx + 8 + (i - 1) * 4, 4))
+            return "index fanout is not sorted";
+    }
+    if (pack.dataSize < 12 + SHA_DIGEST_LENGTH || memcmp(pack.data, PACK_SIGNATURE, 4) != 0 ||
+        getBigEndian(pack.data + 4, 4) != PACK_VERSION)
+        return "bad pack header";
+    if (getBigEndian(pack.data + 8, 4) != pack.count)
+        return "pack and index disagree on the object count";
+    for (uint32_t i = 0; i < pack.count; i++)
     {
-        ipStream.clear();
-        ipStream.seekg(0, ios::beg);
+        if (pack.offsetAt(i) < 12 || pack.offsetAt(i) >= pack.dataSize - SHA_DIGEST_LENGTH)
+            return "index offset out of range for " + pack.idAt(i).toHex();
+    }
+    return "";
+}
+
+// Packs are mapped on first use and stay mapped for the life of the process
+const vector<Pack> &loadedPacks()
+{
+    static vector<Pack> packs;
+    static once_flag loaded;
+    call_once(loaded, []
+              {
+        error_code ec;
+        for (auto &entry : directory_iterator(".mygit/objects/pack", ec))
+        {
+            if (entry.path().extension() != ".idx")
+                continue;
 
-        z_stream deflateStream;
-        deflateStream.zalloc = Z_NULL;
-        deflateStream.zfree = Z_NULL;
-        deflateStream.opaque = Z_NULL;
+            Pack pack;
+            pack.packPath = path(entry.path()).replace_extension(".pack").string();
+            pack.idx = mapFile(entry.path().string(), pack.idxSize);
+            pack.data = mapFile(pack.packPath, pack.dataSize);
+            string error = !pack.idx || !pack.data ? "cannot map pack" : "";
+            if (error.empty())
+            {
+                pack.count = pack.idxSize >= PACK_IDX_HEADER ? getBigEndian(pack.idx + 8 + 255 * 4, 4) : 0;
+                error = checkPackLayout(pack);
+            }
+            if (!error.empty())
+            {
+                cerr << "ERR: Ignoring invalid pack " << entry.path().string() << ": " << error << '\n';
+                if (pack.idx)
+                    munmap(const_cast<char *>(pack.idx), pack.idxSize);
+                if (pack.data)
+                    munmap(const_cast<char *>(pack.data), pack.dataSize);
+                continue;
+            }
+            packs.push_back(pack);
+        } });
+    return packs;
+}
 
-        if (deflateInit(&deflateStream, Z_BEST_COMPRESSION) != Z_OK)
+bool findPacked(const ObjectId &id, const Pack *&pack, uint64_t &offset)
+{
+    for (const Pack &candidate : loadedPacks())
+    {
+        if (candidate.find(id, offset))
         {
-            cerr << "ERR: Could not initialize compression stream\n";
-            return "";
+            pack = &candidate;
+            return true;
         }
+    }
+    return false;
+}
+
+// Decodes the type/size header of the pack entry at offset and returns the
+// position of the data that follows it, or 0 if the entry is malformed
+uint64_t readPackEntryHeader(const Pack &pack, uint64_t offset, int &type, uint64_t &size)
+{
+    if (offset >= pack.dataSize)
+        return 0;
+
+    unsigned char byte = pack.data[offset++];
+    type = (byte >> 4) & 7;
+    size = byte & 15;
+    int shift = 4;
+    while (byte & 0x80)
+    {
+        if (offset >= pack.dataSize || shift > 57)
+            return 0;
+        byte = pack.data[offset++];
+        size |= static_cast<uint64_t>(byte & 0x7f) << shift;
+        shift += 7;
+    }
+    return offset;
+}
+
+// zlib counts buffer sizes in uInt, so input over 4 GiB is handed to the
+// stream in pieces: once the stream has consumed its input, the next piece of
+// [pending, pending + left) is moved in
+void feedInflate(z_stream &stream, const char *&pending, size_t &left)
+{
+    if (stream.avail_in > 0 || left == 0)
+        return;
+    uInt chunk = min<size_t>(left, UINT_MAX);
+    stream.next_in = reinterpret_cast<Bytef *>(const_cast<char *>(pending));
+    stream.avail_in = chunk;
+    pending += chunk;
+    left -= chunk;
+}
+
+// Deflate never expands data more than 1032:1, so a size larger than that
+// many times the compressed bytes available is corrupt
+#define MAX_INFLATE_RATIO 1032
+
+bool inflatePacked(const Pack &pack, uint64_t offset, uint64_t size, string &content)
+{
+    if (offset >= pack.dataSize || size > (pack.dataSize - offset) * MAX_INFLATE_RATIO)
+    {
+        cerr << "ERR: Corrupt object size in " << pack.packPath << '\n';
+        return false;
+    }
 
-        string subdir = sha.substr(0, 2);
-        string filename = sha.substr(2);
-        create_directories(".mygit/objects/" + subdir);
-        string blobpath = ".mygit/objects/" + subdir + "/" + filename;
+    z_stream inflateStream = {};
+    if (inflateInit(&inflateStream) != Z_OK)
+    {
+        cerr << "ERR: Could not initialize decompression stream\n";
+        return false;
+    }
 
-        ofstream outFile(blobpath, ios::binary);
-        if (!outFile)
+    content.resize(size);
+    const char *input = pack.data + offset;
+    size_t inputLeft = pack.dataSize - offset;
+    char *output = content.data();
+    size_t outputLeft = size;
+    int ret = Z_OK;
+    while (ret == Z_OK)
+    {
+        feedInflate(inflateStream, input, inputLeft);
+        if (inflateStream.avail_out == 0 && outputLeft > 0)
         {
-            cerr << "ERR: Cannot create blob file\n";
-            deflateEnd(&deflateStream);
-            return "";
+            uInt chunk = min<size_t>(outputLeft, UINT_MAX);
+            inflateStream.next_out = reinterpret_cast<Bytef *>(output);
+            inflateStream.avail_out = chunk;
+            output += chunk;
+            outputLeft -= chunk;
         }
+        ret = inflate(&inflateStream, Z_NO_FLUSH);
+    }
+    inflateEnd(&inflateStream);
+    if (ret != Z_STREAM_END || inflateStream.total_out != size)
+    {
+        cerr << "ERR: Corrupt object in " << pack.packPath << '\n';
+        return false;
+    }
+    return true;
+}
 
-        deflateStream.avail_in = header.size();
-        deflateStream.next_in = reinterpret_cast<Bytef *>(header.data());
-        char compressBuffer[BUFFER_SIZE];
+void putDeltaSize(string &delta, uint64_t size)
+{
+    do
+    {
+        unsigned char byte = size & 0x7f;
+        size >>= 7;
+        delta.push_back(size ? (byte | 0x80) : byte);
+    } while (size);
+}
 
-        do
+bool getDeltaSize(const string &delta, size_t &pos, uint64_t &size)
+{
+    size = 0;
+    int shift = 0;
+    while (pos < delta.size() && shift < 64)
+    {
+        unsigned char byte = delta[pos++];
+        size |= static_cast<uint64_t>(byte & 0x7f) << shift;
+        shift += 7;
+        if (!(byte & 0x80))
+            return true;
+    }
+    return false;
+}
+
+// Rebuilds an object from its base and a git-style delta: base size, result
+// size, then copy ops (0x80 | offset/size byte flags) and insert ops (1-127
+// literal bytes)
+bool applyDelta(const string &base, const string &delta, string &result)
+{
+    size_t pos = 0;
+    uint64_t baseSize, resultSize;
+    if (!getDeltaSize(delta, pos, baseSize) || !getDeltaSize(delta, pos, resultSize) || baseSize != base.size())
+        return false;
+
+    // resultSize is only trusted as far as the ops back it: the result grows
+    // as they are applied and fails as soon as it passes the declared size
+    result.clear();
+    result.reserve(min<uint64_t>(resultSize, base.size() + delta.size()));
+    while (pos < delta.size())
+    {
+        if (result.size() > resultSize)
+            return false;
+        unsigned char op = delta[pos++];
+        if (op & 0x80)
         {
-            deflateStream.avail_out = BUFFER_SIZE;
-            deflateStream.next_out = reinterpret_cast<Bytef *>(compressBuffer);
-            deflate(&deflateStream, Z_NO_FLUSH);
-            outFile.write(compressBuffer, BUFFER_SIZE - deflateStream.avail_out);
-        } while (deflateStream.avail_out == 0);
+            uint64_t copyOffset = 0, copySize = 0;
+            for (int i = 0; i < 4; i++)
+            {
+                if ((op & (1 << i)) && pos < delta.size())
+                    copyOffset |= static_cast<uint64_t>(static_cast<unsigned char>(delta[pos++])) << (8 * i);
+            }
+            for (int i = 0; i < 3; i++)
+            {
+                if ((op & (0x10 << i)) && pos < delta.size())
+                    copySize |= static_cast<uint64_t>(static_cast<unsigned char>(delta[pos++])) << (8 * i);
+            }
+            if (copySize == 0)
+                copySize = 0x10000;
+            if (copyOffset + copySize > base.size())
+                return false;
+            result.append(base, copyOffset, copySize);
+        }
+        else if (op)
+        {
+            if (pos + op > delta.size())
+                return false;
+            result.append(delta, pos, op);
+            pos += op;
+        }
+        else
+        {
+            return false;
+        }
+    }
+    return result.size() == resultSize;
+}
 
-        while (true)
+#define DELTA_BLOCK 16
+#define DELTA_MAX_COPY 0xffffff
+
+uint32_t hashDeltaBlock(const char *data)
+{
+    uint32_t hash = 2166136261u;
+    for (int i = 0; i < DELTA_BLOCK; i++)
+        hash = (hash ^ static_cast<unsigned char>(data[i])) * 16777619u;
+    return hash;
+}
+
+// Returns a delta that turns base into target, or "" if none smaller than
+// maxSize was found. Base blocks are indexed at DELTA_BLOCK-aligned offsets and
+// every target position is looked up, matches are extended in both directions.
+string createDelta(const string &base, const string &target, size_t maxSize)
+{
+    // Copy offsets are encoded in at most 4 bytes
+    if (base.size() < DELTA_BLOCK || target.size() < DELTA_BLOCK || base.size() > UINT32_MAX)
+        return "";
+
+    unordered_map<uint32_t, uint32_t> blocks;
+    blocks.reserve(base.size() / DELTA_BLOCK);
+    for (size_t offset = 0; offset + DELTA_BLOCK <= base.size(); offset += DELTA_BLOCK)
+        blocks.emplace(hashDeltaBlock(base.data() + offset), offset);
+
+    string delta;
+    putDeltaSize(delta, base.size());
+    putDeltaSize(delta, target.size());
+
+    string insert;
+    auto flushInsert = [&]()
+    {
+        for (size_t start = 0; start < insert.size(); start += 127)
+        {
+            size_t length = min<size_t>(127, insert.size() - start);
+            delta.push_back(static_cast<char>(length));
+            delta.append(insert, start, length);
+        }
+        insert.clear();
+    };
+
+    size_t pos = 0;
+    while (pos < target.size())
+    {
+        if (delta.size() + insert.size() > maxSize)
+            return "";
+
+        if (pos + DELTA_BLOCK <= target.size())
+        {
+            auto match = blocks.find(hashDeltaBlock(target.data() + pos));
+            if (match != blocks.end() && memcmp(base.data() + match->second, target.data() + pos, DELTA_BLOCK) == 0)
+            {
+                size_t copyOffset = match->second;
+                size_t copySize = DELTA_BLOCK;
+                while (copyOffset + copySize < base.size() && pos + copySize < target.size() &&
+                       copySize < DELTA_MAX_COPY && base[copyOffset + copySize] == target[pos + copySize])
+                    copySize++;
+                while (!insert.empty() && copyOffset > 0 && copySize < DELTA_MAX_COPY &&
+                       base[copyOffset - 1] == insert.back())
+                {
+                    insert.pop_back();
+                    copyOffset--;
+                    copySize++;
+                    pos--;
+                }
+
+                flushInsert();
+                unsigned char op = 0x80;
+                string operands;
+                for (int i = 0; i < 4; i++)
+                {
+                    if ((copyOffset >> (8 * i)) & 0xff)
+                    {
+                        op |= 1 << i;
+                        operands.push_back(static_cast<char>(copyOffset >> (8 * i)));
+                    }
+                }
+                for (int i = 0; i < 3; i++)
+                {
+                    if ((copySize >> (8 * i)) & 0xff)
+                    {
+                        op |= 0x10 << i;
+                        operands.push_back(static_cast<char>(copySize >> (8 * i)));
+                    }
+                }
+                delta.push_back(static_cast<char>(op));
+                delta += operands;
+                pos += copySize;
+                continue;
+            }
+        }
+        insert.push_back(target[pos++]);
+    }
+    flushInsert();
+    return delta.size() < maxSize ? delta : "";
+}
+
+// Recently used delta bases, so walking a delta chain (or many deltas against
+// the same base) does not inflate the same objects again
+class DeltaBaseCache
+{
+public:
+    bool get(const Pack *pack, uint64_t offset, string &type, string &content)
+    {
+        lock_guard<mutex> guard(lock);
+        auto it = entries.find({pack, offset});
+        if (it == entries.end())
+            return false;
+        order.splice(order.begin(), order, it->second.position);
+        type = it->second.type;
+        content = it->second.content;
+        return true;
+    }
+
+    void put(const Pack *pack, uint64_t offset, const string &type, const string &content)
+    {
+        if (content.size() > limit / 4)
+            return;
+
+        lock_guard<mutex> guard(lock);
+        if (entries.count({pack, offset}))
+            return;
+        order.push_front({pack, offset});
+        entries[{pack, offset}] = {type, content, order.begin()};
+        used += content.size();
+        while (used > limit)
+        {
+            auto oldest = entries.find(order.back());
+            used -= oldest->second.content.size();
+            entries.erase(oldest);
+            order.pop_back();
+        }
+    }
+
+private:
+    using Key = pair<const Pack *, uint64_t>;
+    struct Entry
+    {
+        string type;
+        string content;
+        list<Key>::iterator position;
+    };
+
+    mutex lock;
+    map<Key, Entry> entries;
+    list<Key> order;
+    size_t used = 0;
+    size_t limit = 64 * 1024 * 1024;
+};
+
+DeltaBaseCache deltaBaseCache;
+
+#define MAX_DELTA_DEPTH 50
+// Objects larger than this are never stored as deltas or used as delta bases,
+// so reading one streams it instead of rebuilding it in memory
+#define BIG_OBJECT_SIZE (16 * 1024 * 1024)
+
+bool readPacked(const Pack &pack, uint64_t offset, string &type, string &content, int depth = 0)
+{
+    int typeCode;
+    uint64_t size;
+    uint64_t dataOffset = readPackEntryHeader(pack, offset, typeCode, size);
+    if (dataOffset == 0 || (typeCode != OBJ_REF_DELTA && packTypeName(typeCode).empty()))
+    {
+        cerr << "ERR: Corrupt object in " << pack.packPath << '\n';
+        return false;
+    }
+
+    if (typeCode != OBJ_REF_DELTA)
+    {
+        type = packTypeName(typeCode);
+        return inflatePacked(pack, dataOffset, size, content);
+    }
+
+    const Pack *basePack;
+    uint64_t baseOffset;
+    string baseContent, delta;
+    if (depth > MAX_DELTA_DEPTH * 2 || dataOffset + SHA_DIGEST_LENGTH > pack.dataSize ||
+        !findPacked(ObjectId::fromRaw(pack.data + dataOffset), basePack, baseOffset))
+    {
+        cerr << "ERR: Missing delta base in " << pack.packPath << '\n';
+        return false;
+    }
+    if (!deltaBaseCache.get(basePack, baseOffset, type, baseContent))
+    {
+        if (!readPacked(*basePack, baseOffset, type, baseContent, depth + 1))
+            return false;
+        deltaBaseCache.put(basePack, baseOffset, type, baseContent);
+    }
+    if (!inflatePacked(pack, dataOffset + SHA_DIGEST_LENGTH, size, delta) ||
+        !applyDelta(baseContent, delta, content))
+    {
+        cerr << "ERR: Corrupt delta in " << pack.packPath << '\n';
+        return false;
+    }
+    return true;
+}
+
+string objectPath(const ObjectId &id)
+{
+    string sha = id.toHex();
+    return ".mygit/objects/" + sha.substr(0, 2) + "/" + sha.substr(2);
+}
+
+bool objectExists(const ObjectId &id)
+{
+    const Pack *pack;
+    uint64_t offset;
+    return findPacked(id, pack, offset) || access(objectPath(id).c_str(), F_OK) == 0;
+}
+
+// Reads one object at a time as a stream. open() decodes only the header, so
+// type and size are known without inflating the content; read() then inflates
+// it chunk by chunk straight from the mapped loose file or pack. Deltas are
+// the exception: they are rebuilt in memory on the first read(). repack keeps
+// objects over BIG_OBJECT_SIZE out of delta chains, so this costs at most a
+// bounded base and result. A reader can be reopened for any number of objects
+// and reuses its inflate state.
+class ObjectReader
+{
+public:
+    string type;
+    uint64_t size = 0;
+
+    ObjectReader()
+    {
+        stream = {};
+        ready = inflateInit(&stream) == Z_OK;
+    }
+
+    ~ObjectReader()
+    {
+        unmap();
+        if (ready)
+            inflateEnd(&stream);
+    }
+
+    ObjectReader(const ObjectReader &) = delete;
+    ObjectReader &operator=(const ObjectReader &) = delete;
+
+    // Returns false if the object does not exist or its header is corrupt
+    bool open(const ObjectId &id)
+    {
+        if (!reset())
+            return false;
+
+        const Pack *packFound;
+        uint64_t offset;
+        if (findPacked(id, packFound, offset))
+            return openPacked(*packFound, offset);
+        return openLoose(id);
+    }
+
+    // Open one particular stored copy of an object, even when another copy
+    // would be preferred
+    bool openLooseCopy(const ObjectId &id)
+    {
+        return reset() && openLoose(id);
+    }
+
+    bool openPackEntry(const Pack &packFound, uint64_t offset)
+    {
+        return reset() && openPacked(packFound, offset);
+    }
+
+    // Copies up to length bytes of content into buffer. Returns the number of
+    // bytes copied, 0 at the end of the object, -1 on corruption.
+    ssize_t read(char *buffer, size_t length)
+    {
+        if (source == DELTA)
+        {
+            string content;
+            if (!readPacked(*pack, packOffset, type, content))
+                return -1;
+            pending = move(content);
+            pendingPos = 0;
+            source = MEMORY;
+        }
+
+        if (pendingPos < pending.size())
+        {
+            size_t copied = min(length, pending.size() - pendingPos);
+            memcpy(buffer, pending.data() + pendingPos, copied);
+            pendingPos += copied;
+            delivered += copied;
+            return copied;
+        }
+        if (source == MEMORY || source == NONE || finished)
+            return delivered == size ? 0 : -1;
+
+        while (true)
+        {
+            uInt room = min<size_t>(length, UINT_MAX);
+            stream.next_out = reinterpret_cast<Bytef *>(buffer);
+            stream.avail_out = room;
+            feedInflate(stream, input, inputLeft);
+            int ret = inflate(&stream, Z_NO_FLUSH);
+            size_t produced = room - stream.avail_out;
+            delivered += produced;
+            if (ret == Z_STREAM_END)
+                finished = true;
+            else if (ret != Z_OK || (produced == 0 && stream.avail_in == 0 && inputLeft == 0))
+                return -1;
+
+            if (delivered > size || (finished && delivered != size))
+                return -1;
+            if (produced > 0 || finished)
+                return produced;
+        }
+    }
+
+    bool readAll(string &content)
+    {
+        content.clear();
+        // A rebuilt delta arrives whole, its size is not backed by the input
+        if (source != DELTA)
+            content.reserve(size);
+        char buffer[BUFFER_SIZE];
+        ssize_t bytesRead;
+        while ((bytesRead = read(buffer, BUFFER_SIZE)) > 0)
+            content.append(buffer, bytesRead);
+        return bytesRead == 0;
+    }
+
+private:
+    enum Source
+    {
+        NONE,
+        LOOSE,
+        PACKED,
+        DELTA,
+        MEMORY,
+    };
+
+    z_stream stream;
+    bool ready = false;
+    Source source = NONE;
+    const char *mapped = nullptr;
+    size_t mappedSize = 0;
+    const Pack *pack = nullptr;
+    uint64_t packOffset = 0;
+    // content already inflated while decoding the header, or a rebuilt delta
+    string pending;
+    size_t pendingPos = 0;
+    uint64_t delivered = 0;
+    bool finished = false;
+    // compressed input not yet handed to the stream, see feedInflate
+    const char *input = nullptr;
+    size_t inputLeft = 0;
+
+    void unmap()
+    {
+        if (mapped)
+            munmap(const_cast<char *>(mapped), mappedSize);
+        mapped = nullptr;
+    }
+
+    void startInput(const char *start, size_t length)
+    {
+        stream.avail_in = 0;
+        input = start;
+        inputLeft = length;
+    }
+
+    bool reset()
+    {
+        unmap();
+        source = NONE;
+        pending.clear();
+        pendingPos = 0;
+        delivered = 0;
+        finished = false;
+        return ready;
+    }
+
+    bool openLoose(const ObjectId &id)
+    {
+        mapped = mapFile(objectPath(id), mappedSize);
+        if (!mapped)
+            return false;
+
+        inflateReset(&stream);
+        startInput(mapped, mappedSize);
+
+        // "type size\0" is short; inflate a few bytes at a time until it ends
+        char headerBuffer[32];
+        string header;
+        size_t nullPos = string::npos;
+        while (nullPos == string::npos && header.size() < 64)
+        {
+            stream.next_out = reinterpret_cast<Bytef *>(headerBuffer);
+            stream.avail_out = sizeof(headerBuffer);
+            feedInflate(stream, input, inputLeft);
+            int ret = inflate(&stream, Z_NO_FLUSH);
+            header.append(headerBuffer, sizeof(headerBuffer) - stream.avail_out);
+            nullPos = header.find('\0');
+            if (ret == Z_STREAM_END)
+                finished = true;
+            else if (ret != Z_OK)
+                break;
+            if (finished)
+                break;
+        }
+        if (nullPos == string::npos)
+            return false;
+
+        istringstream typeAndSize(header.substr(0, nullPos));
+        if (!(typeAndSize >> type >> size) || size > mappedSize * MAX_INFLATE_RATIO)
+            return false;
+        pending = header.substr(nullPos + 1);
+        source = LOOSE;
+        return true;
+    }
+
+    bool openPacked(const Pack &packFound, uint64_t offset)
+    {
+        int typeCode;
+        uint64_t entrySize;
+        uint64_t dataOffset = readPackEntryHeader(packFound, offset, typeCode, entrySize);
+        if (dataOffset == 0)
+            return false;
+
+        pack = &packFound;
+        packOffset = offset;
+        if (typeCode != OBJ_REF_DELTA)
+        {
+            type = packTypeName(typeCode);
+            size = entrySize;
+            if (size > (packFound.dataSize - dataOffset) * MAX_INFLATE_RATIO)
+                return false;
+            inflateReset(&stream);
+            startInput(packFound.data + dataOffset, packFound.dataSize - dataOffset);
+            source = PACKED;
+            return !type.empty();
+        }
+
+        // The type comes from the end of the delta chain, the size from the
+        // start of the delta itself
+        const Pack *basePack = &packFound;
+        uint64_t baseOffset = offset;
+        uint64_t baseData = dataOffset;
+        int baseType = typeCode;
+        for (int depth = 0; baseType == OBJ_REF_DELTA; depth++)
+        {
+            if (depth > MAX_DELTA_DEPTH * 2 || baseData + SHA_DIGEST_LENGTH > basePack->dataSize ||
+                !findPacked(ObjectId::fromRaw(basePack->data + baseData), basePack, baseOffset))
+                return false;
+            uint64_t baseSize;
+            baseData = readPackEntryHeader(*basePack, baseOffset, baseType, baseSize);
+            if (baseData == 0)
+                return false;
+        }
+        type = packTypeName(baseType);
+
+        char deltaHeader[32];
+        inflateReset(&stream);
+        startInput(packFound.data + dataOffset + SHA_DIGEST_LENGTH, packFound.dataSize - dataOffset - SHA_DIGEST_LENGTH);
+        stream.next_out = reinterpret_cast<Bytef *>(deltaHeader);
+        stream.avail_out = sizeof(deltaHeader);
+        feedInflate(stream, input, inputLeft);
+        int ret = inflate(&stream, Z_NO_FLUSH);
+        if (ret != Z_OK && ret != Z_STREAM_END)
+            return false;
+
+        string delta(deltaHeader, sizeof(deltaHeader) - stream.avail_out);
+        size_t pos = 0;
+        uint64_t baseSize;
+        if (!getDeltaSize(delta, pos, baseSize) || !getDeltaSize(delta, pos, size))
+            return false;
+        source = DELTA;
+        return !type.empty();
+    }
+};
+
+// Streams an object through SHA-1 and (optionally) deflate in a single pass.
+// The "type size\0" header is fed first, then every chunk passed to write().
+// Compressed output goes to a temp file that finish() renames to the object
+// path once the id is known, unless an object with that id is already stored.
+class ObjectWriter
+{
+public:
+    ObjectWriter(const string &objtype, size_t size, bool store) : storing(store)
+    {
+        SHA1_Init(&shaContext);
+
+        if (storing)
+        {
+            error_code ec;
+            create_directories(".mygit/objects", ec);
+            tempPath = ".mygit/objects/tmp_obj_XXXXXX";
+            fd = mkstemp(tempPath.data());
+            if (fd < 0)
+            {
+                cerr << "ERR: Cannot create blob file\n";
+                failed = true;
+            }
+
+            deflateStream.zalloc = Z_NULL;
+            deflateStream.zfree = Z_NULL;
+            deflateStream.opaque = Z_NULL;
+            if (deflateInit(&deflateStream, Z_BEST_COMPRESSION) != Z_OK)
+            {
+                cerr << "ERR: Could not initialize compression stream\n";
+                failed = true;
+            }
+            else
+            {
+                deflating = true;
+            }
+        }
+
+        string header = objtype + " " + to_string(size) + '\0';
+        write(header.data(), header.size());
+    }
+
+    ~ObjectWriter()
+    {
+        if (deflating)
+            deflateEnd(&deflateStream);
+        if (fd >= 0)
+        {
+            close(fd);
+            unlink(tempPath.c_str());
+        }
+    }
+
+    bool write(const char *data, size_t length)
+    {
+        SHA1_Update(&shaContext, data, length);
+        if (!storing || failed)
+            return !failed;
+
+        deflateStream.avail_in = length;
+        deflateStream.next_in = reinterpret_cast<Bytef *>(const_cast<char *>(data));
+        return pump(Z_NO_FLUSH);
+    }
+
+    // Returns the object id, or the null id if the object could not be stored
+    ObjectId finish()
+    {
+        ObjectId sha;
+        SHA1_Final(sha.hash, &shaContext);
+        if (!storing)
+            return sha;
+
+        deflateStream.avail_in = 0;
+        deflateStream.next_in = nullptr;
+        if (failed || !pump(Z_FINISH))
+            return ObjectId();
+
+        deflateEnd(&deflateStream);
+        deflating = false;
+        fchmod(fd, 0444);
+        close(fd);
+        fd = -1;
+
+        if (objectExists(sha))
+        {
+            unlink(tempPath.c_str());
+            return sha;
+        }
+
+        error_code ec;
+        string objPath = objectPath(sha);
+        create_directories(path(objPath).parent_path(), ec);
+        if (rename(tempPath.c_str(), objPath.c_str()) != 0)
+        {
+            cerr << "ERR: Cannot store object " << sha << '\n';
+            unlink(tempPath.c_str());
+            return ObjectId();
+        }
+        return sha;
+    }
+
+private:
+    SHA_CTX shaContext;
+    z_stream deflateStream;
+    bool storing;
+    bool deflating = false;
+    bool failed = false;
+    string tempPath;
+    int fd = -1;
+    char compressBuffer[BUFFER_SIZE];
+
+    bool pump(int flush)
+    {
+        do
+        {
+            deflateStream.avail_out = BUFFER_SIZE;
+            deflateStream.next_out = reinterpret_cast<Bytef *>(compressBuffer);
+            deflate(&deflateStream, flush);
+            size_t produced = BUFFER_SIZE - deflateStream.avail_out;
+            if (produced > 0 && ::write(fd, compressBuffer, produced) != static_cast<ssize_t>(produced))
+            {
+                cerr << "ERR: Cannot write object file\n";
+                failed = true;
+                return false;
+            }
+        } while (deflateStream.avail_out == 0);
+        return true;
+    }
+};
+
+// Objects up to this size are read into memory so that content which is
+// already stored costs one read and a hash, with no compression
+#define SMALL_OBJECT_SIZE 1024 * 1024
+
+ObjectId storeObject(const string &objtype, const char *data, size_t size, bool store)
+{
+    ObjectWriter hasher(objtype, size, false);
+    hasher.write(data, size);
+    ObjectId sha = hasher.finish();
+    if (!store || objectExists(sha))
+        return sha;
+
+    ObjectWriter writer(objtype, size, true);
+    writer.write(data, size);
+    return writer.finish();
+}
+
+ObjectId hashObject(string filepath, bool create_blob, bool printsha = false)
+{
+    ifstream ipStream(filepath, ios::binary);
+    if (!ipStream)
+    {
+        cerr << "Err: Cannot open file " << filepath << "\n";
+        return ObjectId();
+    }
+
+    ipStream.seekg(0, ios::end);
+    size_t filesize = ipStream.tellg();
+    ipStream.seekg(0, ios::beg);
+
+    ObjectId sha;
+    if (filesize <= SMALL_OBJECT_SIZE)
+    {
+        string content(filesize, '\0');
+        ipStream.read(content.data(), filesize);
+        sha = storeObject("blob", content.data(), ipStream.gcount(), create_blob);
+    }
+    else
+    {
+        // Large files are hashed in a first pass and only deflated in a
+        // second one when the object is not stored yet
+        for (bool store : {false, true})
+        {
+            ObjectWriter writer("blob", filesize, store);
+            char buffer[BUFFER_SIZE];
+            ipStream.clear();
+            ipStream.seekg(0, ios::beg);
+            while (true)
+            {
+                ipStream.read(buffer, BUFFER_SIZE);
+                streamsize bytesRead = ipStream.gcount();
+                if (bytesRead == 0)
+                    break;
+
+                writer.write(buffer, bytesRead);
+            }
+            sha = writer.finish();
+            if (!create_blob || sha.isNull() || objectExists(sha))
+                break;
+        }
+    }
+    if (printsha && !sha.isNull())
+    {
+        cout << "sha1 " << sha << '\n';
+        if (create_blob)
+            cout << "Compressed and stored object at " << objectPath(sha) << '\n';
+    }
+
+    return sha;
+}
+
+// Hashes (and with create_blob, stores) every file named on stdin, printing
+// one id per line in input order. Files are hashed and deflated on the pool
+// while the main thread keeps reading paths, with a bounded number in flight.
+int hashStdinPaths(bool create_blob)
+{
+    ios::sync_with_stdio(false);
+    cin.tie(nullptr);
+
+    ThreadPool &pool = workPool();
+    size_t window = 4 * max(jobs, 1u);
+    deque<future<ObjectId>> inFlight;
+    int status = 0;
+    auto printOldest = [&]()
+    {
+        ObjectId sha = pool.wait(inFlight.front());
+        inFlight.pop_front();
+        if (sha.isNull())
+        {
+            status = 1;
+            cout << '\n';
+            return;
+        }
+        cout << sha << '\n';
+    };
+
+    string filepath;
+    while (getline(cin, filepath))
+    {
+        inFlight.push_back(pool.submit([filepath, create_blob]
+                                       { return hashObject(filepath, create_blob); }));
+        if (inFlight.size() >= window)
+            printOldest();
+    }
+    while (!inFlight.empty())
+        printOldest();
+    cout.flush();
+    return status;
+}
+
+int catFile(string &flag, string &fileSha)
+{
+    if (flag != "-t" && flag != "-s" && flag != "-p")
+    {
+        cerr << "ERR: Invalid flag\n";
+        return 1;
+    }
+
+    ObjectId id;
+    ObjectReader reader;
+    if (!ObjectId::fromHex(fileSha, id) || !reader.open(id))
+    {
+        cerr << "ERR: Cannot open object " << fileSha << "\n";
+        return 1;
+    }
+
+    if (flag == "-t")
+    {
+        cout << reader.type << '\n';
+    }
+    else if (flag == "-s")
+    {
+        cout << reader.size << '\n';
+    }
+    else
+    {
+        char buffer[BUFFER_SIZE];
+        ssize_t bytesRead;
+        while ((bytesRead = reader.read(buffer, BUFFER_SIZE)) > 0)
+            cout.write(buffer, bytesRead);
+        if (bytesRead < 0)
+        {
+            cerr << "ERR: Decompression error\n";
+            return 1;
+        }
+        cout << '\n';
+    }
+    return 0;
+}
+
+// Reads object ids from stdin, one per line, and writes "<sha> <type> <size>"
+// for each (followed by the content and a newline unless checkOnly). One
+// reader and one buffer serve every object.
+int catFileBatch(bool checkOnly)
+{
+    ios::sync_with_stdio(false);
+    cin.tie(nullptr);
+
+    ObjectReader reader;
+    vector<char> buffer(BUFFER_SIZE);
+    string sha;
+    ObjectId id;
+    while (getline(cin, sha))
+    {
+        if (!ObjectId::fromHex(sha, id) || !reader.open(id))
+        {
+            cout << sha << " missing\n";
+            continue;
+        }
+
+        cout << sha << ' ' << reader.type << ' ' << reader.size << '\n';
+        if (checkOnly)
+            continue;
+
+        ssize_t bytesRead;
+        while ((bytesRead = reader.read(buffer.data(), buffer.size())) > 0)
+            cout.write(buffer.data(), bytesRead);
+        if (bytesRead < 0)
+        {
+            cout.flush();
+            cerr << "ERR: Decompression error in " << sha << '\n';
+            return 1;
+        }
+        cout << '\n';
+    }
+    cout.flush();
+    return 0;
+}
+
+ObjectId writeBlob(path &filepath)
+{
+    return hashObject(filepath.string(), false);
+}
+
+ObjectId writeObject(string &object, string objtype)
+{
+    return storeObject(objtype, object.data(), object.size(), true);
+}
+
+// Git's tree order: byte order of the names, where a directory compares as
+// if its name ended in '/'. Producing trees in one fixed order is what makes
+// identical directories hash the same.
+int compareTreeNames(string_view a, bool aIsTree, string_view b, bool bIsTree)
+{
+    size_t common = min(a.size(), b.size());
+    int cmp = memcmp(a.data(), b.data(), common);
+    if (cmp != 0)
+        return cmp;
+    auto next = [common](string_view name, bool isTree) -> int
+    {
+        if (common < name.size())
+            return static_cast<unsigned char>(name[common]);
+        return isTree ? '/' : '\0';
+    };
+    return next(a, aIsTree) - next(b, bIsTree);
+}
+
+bool treeOrderLess(const TreeEntry &a, const TreeEntry &b)
+{
+    return compareTreeNames(a.filename, a.filetype == "tree", b.filename, b.filetype == "tree") < 0;
+}
+
+// Sorts the entries into tree order and stores the resulting tree
+ObjectId writeTreeEntries(vector<TreeEntry> &entries)
+{
+    sort(entries.begin(), entries.end(), treeOrderLess);
+    string treeData;
+    for (const TreeEntry &entry : entries)
+        treeData += entry.filemod + " " + entry.filename + '\0' + entry.filehash.toHex();
+    return writeObject(treeData, "tree");
+}
+
+ObjectId writeTree(path directoryPath)
+{
+    // Blobs and subtrees are hashed as pool tasks, then sorted into tree order
+    ThreadPool &pool = workPool();
+    vector<future<TreeEntry>> pending;
+
+    for (auto &entry : directory_iterator(directoryPath))
+    {
+        if (entry.is_regular_file())
+        {
+            path filepath = entry.path();
+            pending.push_back(pool.submit([filepath]
+                                          { return TreeEntry{"100644", filepath.filename().string(), "blob", hashObject(filepath, true)}; }));
+        }
+        else if (entry.is_directory())
+        {
+            if (entry.path().filename() == ".mygit" || entry.path().filename() == ".git")
+                continue;
+
+            path dirpath = entry.path();
+            pending.push_back(pool.submit([dirpath]
+                                          { return TreeEntry{"040000", dirpath.filename().string(), "tree", writeTree(dirpath)}; }));
+        }
+    }
+
+    vector<TreeEntry> entries;
+    for (auto &entry : pending)
+    {
+        entries.push_back(pool.wait(entry));
+    }
+
+    return writeTreeEntries(entries);
+}
+
+string getObjData(const ObjectId &tree_sha);
+
+string decompressFile(const ObjectId &tree_sha)
+{
+    return getObjData(tree_sha);
+}
+
+ObjectId extractTreeSHA(const string &commitObject)
+{
+    istringstream ss(commitObject);
+    string header, userName, userEmail, treeSHA;
+
+    getline(ss, header, '\0');
+    getline(ss, userName, '\0');
+    getline(ss, userEmail, '\0');
+    getline(ss, treeSHA, '\0');
+    return ObjectId::parse(treeSHA);
+}
+
+enum TreeMode
+{
+    MODE_UNKNOWN = 0,
+    MODE_FILE,       // 100644
+    MODE_EXECUTABLE, // 100755
+    MODE_SYMLINK,    // 120000
+    MODE_TREE,       // 040000
+};
+
+TreeMode parseTreeMode(string_view mode)
+{
+    if (mode == "100644")
+        return MODE_FILE;
+    if (mode == "040000" || mode == "40000")
+        return MODE_TREE;
+    if (mode == "100755")
+        return MODE_EXECUTABLE;
+    if (mode == "120000")
+        return MODE_SYMLINK;
+    return MODE_UNKNOWN;
+}
+
+const char *treeModeString(TreeMode mode)
+{
+    switch (mode)
+    {
+    case MODE_TREE:
+        return "040000";
+    case MODE_EXECUTABLE:
+        return "100755";
+    case MODE_SYMLINK:
+        return "120000";
+    default:
+        return "100644";
+    }
+}
+
+// One entry of a tree object. name points into the tree's buffer.
+struct TreeItem
+{
+    TreeMode mode;
+    string_view name;
+    ObjectId id;
+
+    bool isTree() const
+    {
+        return mode == MODE_TREE;
+    }
+};
+
+// Iterates the entries of an inflated tree object ("tree size\0" followed by
+// "mode name\0<hex id>" entries) in place, without allocating. The buffer must
+// outlive the view; iteration stops at the first malformed entry.
+class TreeView
+{
+public:
+    class iterator
+    {
+    public:
+        iterator(const char *start, const char *end) : next(start), end(end)
+        {
+            advance();
+        }
+
+        const TreeItem &operator*() const
+        {
+            return item;
+        }
+
+        const TreeItem *operator->() const
+        {
+            return &item;
+        }
+
+        iterator &operator++()
+        {
+            advance();
+            return *this;
+        }
+
+        bool operator!=(const iterator &other) const
+        {
+            return current != other.current;
+        }
+
+    private:
+        const char *current = nullptr;
+        const char *next;
+        const char *end;
+        TreeItem item;
+
+        void advance()
+        {
+            current = next;
+            if (current == end)
+                return;
+
+            const char *space = static_cast<const char *>(memchr(current, ' ', end - current));
+            const char *nul = space ? static_cast<const char *>(memchr(space + 1, '\0', end - space - 1)) : nullptr;
+            if (!nul || end - nul - 1 < 2 * SHA_DIGEST_LENGTH ||
+                !ObjectId::fromHex(string_view(nul + 1, 2 * SHA_DIGEST_LENGTH), item.id))
+            {
+                current = next = end;
+                return;
+            }
+            item.mode = parseTreeMode(string_view(current, space - current));
+            item.name = string_view(space + 1, nul - space - 1);
+            next = nul + 1 + 2 * SHA_DIGEST_LENGTH;
+        }
+    };
+
+    explicit TreeView(string_view object)
+    {
+        size_t nullPos = object.find('\0');
+        valid = nullPos != string_view::npos && object.compare(0, 5, "tree ") == 0;
+        entries = valid ? object.substr(nullPos + 1) : string_view();
+    }
+
+    bool isValid() const
+    {
+        return valid;
+    }
+
+    iterator begin() const
+    {
+        return iterator(entries.data(), entries.data() + entries.size());
+    }
+
+    iterator end() const
+    {
+        return iterator(entries.data() + entries.size(), entries.data() + entries.size());
+    }
+
+private:
+    string_view entries;
+    bool valid;
+};
+
+TreeEntry toTreeEntry(const TreeItem &item)
+{
+    return {treeModeString(item.mode), string(item.name), item.isTree() ? "tree" : "blob", item.id};
+}
+
+unordered_map<string, TreeEntry> parseTreeDataMap(const string &treeData)
+{
+    unordered_map<string, TreeEntry> newTreeMap;
+    TreeView tree(treeData);
+    if (!tree.isValid())
+    {
+        cout << "Not a tree objectxxx " << treeData << "\n";
+        return newTreeMap;
+    }
+
+    for (const TreeItem &item : tree)
+    {
+        newTreeMap.emplace(item.name, toTreeEntry(item));
+        if (debugTrace)
+            cerr << "entry: " << item.name << '\n'
+                 << item.id << '\n';
+    }
+    return newTreeMap;
+}
+
+vector<TreeEntry> parseTreeData(const string &treeData)
+{
+    vector<TreeEntry> entries;
+    TreeView tree(treeData);
+    if (!tree.isValid())
+    {
+        cout << "Not a tree objectyyy " << treeData << "\n ";
+        return entries;
+    }
+
+    for (const TreeItem &item : tree)
+        entries.push_back(toTreeEntry(item));
+    return entries;
+}
+
+void displayTree(vector<TreeEntry> &entries, bool nameonly)
+{
+    if (nameonly)
+    {
+        for (TreeEntry entry : entries)
+        {
+            cout << entry.filename;
+            if (entry.filetype == "tree")
+                cout << "/";
+            cout << '\n';
+        }
+    }
+    else
+    {
+        for (TreeEntry entry : entries)
+        {
+            cout << entry.filemod << "  " << entry.filetype << "  " << entry.filehash << "  " << entry.filename << '\n';
+        }
+    }
+}
+
+string getObjData(const ObjectId &tree_sha)
+{
+    ObjectReader reader;
+    string content;
+    if (!reader.open(tree_sha))
+    {
+        cerr << "Tree object not foundyyyy" << tree_sha << "\n";
+        return {};
+    }
+    if (!reader.readAll(content))
+    {
+        cerr << "ERR: Decompression error\n";
+        return {};
+    }
+    return reader.type + " " + to_string(reader.size) + '\0' + content;
+}
+
+unordered_map<string, TreeEntry> getTreeData(const ObjectId &tree_sha)
+{
+    string treeData = getObjData(tree_sha);
+    if (treeData.empty())
+    {
+        cerr << "ERR: Failed to decompress tree object\n";
+        return {};
+    }
+
+    return parseTreeDataMap(treeData);
+}
+
+int lstree(const ObjectId &tree_sha, bool nameonly)
+{
+    string treeData = getObjData(tree_sha);
+    if (debugTrace)
+        cerr << "treedata " << treeData << '\n';
+    if (treeData.empty())
+    {
+        cerr << "ERR: Failed to decompress tree object\n";
+        return 1;
+    }
+
+    vector<TreeEntry> entries = parseTreeData(treeData);
+    if (entries.empty())
+    {
+        return 1;
+    }
+    displayTree(entries, nameonly);
+
+    return 0;
+}
+
+void fillStat(Metadata &entry, const struct stat &st)
+{
+    entry.ctimeSec = st.st_ctim.tv_sec;
+    entry.ctimeNsec = st.st_ctim.tv_nsec;
+    entry.mtimeSec = st.st_mtim.tv_sec;
+    entry.mtimeNsec = st.st_mtim.tv_nsec;
+    entry.dev = st.st_dev;
+    entry.ino = st.st_ino;
+    entry.size = st.st_size;
+}
+
+#define INDEX_SIGNATURE "MIDX"
+#define INDEX_VERSION 2
+// ctime, ctime_ns, mtime, mtime_ns, dev, ino, size, mode, sha, path length
+#define INDEX_ENTRY_FIXED (8 + 4 + 8 + 4 + 8 + 8 + 8 + 4 + SHA_DIGEST_LENGTH + 2)
+#define INDEX_EXT_CACHE_TREE "TREE"
+#define INDEX_EXT_FSMONITOR "FSMN"
+#define INDEX_EXT_UNTRACKED "UNTR"
+#define INDEX_EXT_UNTRACKED_CONTENTS "UNTD"
+
+// A tree already written for one staged directory, and how many index
+// entries it covers
+struct CacheTreeNode
+{
+    ObjectId id;
+    uint32_t entryCount = 0;
+};
+
+// The untracked files and directories ("name/") of one directory, as of the
+// given directory mtime
+struct UntrackedDir
+{
+    int64_t mtimeSec = 0;
+    int64_t mtimeNsec = 0;
+    vector<string> names;
+};
+
+// A directory and its mtime when it was read
+struct DirStamp
+{
+    string path;
+    int64_t mtimeSec = 0;
+    int64_t mtimeNsec = 0;
+};
+
+// Whether an untracked directory holds a file at any depth, with the
+// directories whose mtimes vouch for the answer: the one holding the file
+// that was found, or every directory searched when there was none
+struct UntrackedContents
+{
+    bool hasFiles = false;
+    vector<DirStamp> stamps;
+};
+
+// The staging area. On disk it is "MIDX", a version and an entry count, the
+// entries sorted by path with fixed-width big-endian stat fields and a binary
+// id, optional extensions ("TREE" and a length, then the data), then a SHA-1
+// of everything before it. The file is mapped read-only and entry paths point
+// into the mapping; paths added during the command are owned by the index.
+// Commands that change it take .mygit/index.lock before loading and write
+// the new index through it.
+class Index
+{
+public:
+    vector<Metadata> entries;
+    // Cache-tree: directory path ("" for the root) to the tree of its staged
+    // entries. A directory is dropped whenever an entry below it changes.
+    map<string, CacheTreeNode> cacheTree;
+    // Whether the index was written with a cache-tree, i.e. by a commit
+    bool hasCacheTree = false;
+    // Last fsmonitor token the index was brought up to date with, and the
+    // paths that were still found changed at that point
+    string fsmonitorToken;
+    vector<string> fsmonitorDirty;
+    // Untracked cache: directory ("" or "a/b/") to its untracked names
+    map<string, UntrackedDir> untrackedCache;
+    // Untracked directory ("a/b/") to whether it holds any file
+    map<string, UntrackedContents> untrackedContents;
+
+    Index() = default;
+    Index(const Index &) = delete;
+    Index &operator=(const Index &) = delete;
+
+    ~Index()
+    {
+        if (mapped)
+            munmap(mapped, mappedSize);
+        if (lockFd >= 0)
+        {
+            close(lockFd);
+            unlink(".mygit/index.lock");
+        }
+    }
+
+    // Takes .mygit/index.lock for a command that writes the index back. Called
+    // before load(), so that no other process can save in between; the lock is
+    // held until save() renames it into place or the index is destroyed.
+    bool lock()
+    {
+        lockFd = open(".mygit/index.lock", O_WRONLY | O_CREAT | O_EXCL, 0644);
+        if (lockFd < 0)
+        {
+            cerr << "ERR: Cannot lock index, is another mygit process running?\n";
+            return false;
+        }
+        return true;
+    }
+
+    // Takes the lock for a command that loaded the index without it and only
+    // wants to save refreshed cached data. Fails quietly if another process
+    // holds the lock or has saved the index since it was loaded.
+    bool tryLock()
+    {
+        lockFd = open(".mygit/index.lock", O_WRONLY | O_CREAT | O_EXCL, 0644);
+        if (lockFd < 0)
+            return false;
+        struct stat st;
+        bool unchanged = stat(".mygit/index", &st) == 0
+                             ? st.st_mtim.tv_sec == mtimeSec && st.st_mtim.tv_nsec == mtimeNsec
+                             : mtimeSec == 0 && mtimeNsec == 0;
+        if (!unchanged)
+        {
+            close(lockFd);
+            unlink(".mygit/index.lock");
+            lockFd = -1;
+        }
+        return unchanged;
+    }
+
+    // A missing index is an empty one. Returns false if the index is corrupt.
+    bool load()
+    {
+        int fd = open(".mygit/index", O_RDONLY);
+        if (fd < 0)
+            return true;
+
+        struct stat st;
+        fstat(fd, &st);
+        mtimeSec = st.st_mtim.tv_sec;
+        mtimeNsec = st.st_mtim.tv_nsec;
+        if (st.st_size > 0)
+        {
+            void *data = mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+            if (data != MAP_FAILED)
+            {
+                mapped = static_cast<char *>(data);
+                mappedSize = st.st_size;
+            }
+        }
+        close(fd);
+        if (!mapped)
+            return true;
+
+        if (mappedSize >= 12 && memcmp(mapped, INDEX_SIGNATURE, 4) == 0)
+            return parseBinary();
+        return parseText();
+    }
+
+    const Metadata *find(string_view filepath) const
+    {
+        auto it = lower_bound(entries.begin(), entries.begin() + sortedCount, filepath,
+                              [](const Metadata &entry, string_view name)
+                              { return entry.path < name; });
+        if (it != entries.begin() + sortedCount && it->path == filepath)
+            return &*it;
+
+        auto added = addedPositions.find(filepath);
+        if (added != addedPositions.end())
+            return &entries[added->second];
+        return nullptr;
+    }
+
+    Metadata *find(string_view filepath)
+    {
+        return const_cast<Metadata *>(static_cast<const Index &>(*this).find(filepath));
+    }
+
+    // Returns the entry for filepath, creating it if it is not staged yet
+    Metadata &upsert(string_view filepath)
+    {
+        Metadata *entry = find(filepath);
+        if (entry)
+        {
+            entry->removed = false;
+            return *entry;
+        }
+
+        ownedPaths.emplace_back(filepath);
+        entries.emplace_back();
+        entries.back().path = ownedPaths.back();
+        addedPositions[entries.back().path] = entries.size() - 1;
+        return entries.back();
+    }
+
+    // Whether any staged path starts with prefix ("dir/")
+    bool hasEntriesUnder(string_view prefix) const
+    {
+        auto it = lower_bound(entries.begin(), entries.begin() + sortedCount, prefix,
+                              [](const Metadata &entry, string_view name)
+                              { return entry.path < name; });
+        for (; it != entries.begin() + sortedCount && it->path.compare(0, prefix.size(), prefix) == 0; ++it)
+        {
+            if (!it->removed)
+                return true;
+        }
+        for (auto &[name, position] : addedPositions)
+        {
+            if (!entries[position].removed && name.compare(0, prefix.size(), prefix) == 0)
+                return true;
+        }
+        return false;
+    }
+
+    // Calls visit for the staged files directly in dir ("" or "a/b/") and
+    // for its subdirectories that have staged files
+    void listChildren(string_view dir, const function<void(string_view name, bool isDir)> &visit) const
+    {
+        auto it = lower_bound(entries.begin(), entries.begin() + sortedCount, dir,
+                              [](const Metadata &entry, string_view name)
+                              { return entry.path < name; });
+        string_view lastDir;
+        for (; it != entries.begin() + sortedCount && it->path.compare(0, dir.size(), dir) == 0; ++it)
+        {
+            if (it->removed)
+                continue;
+            string_view rest = it->path.substr(dir.size());
+            size_t slash = rest.find('/');
+            if (slash == string_view::npos)
+                visit(rest, false);
+            else if (rest.substr(0, slash) != lastDir)
+            {
+                lastDir = rest.substr(0, slash);
+                visit(lastDir, true);
+            }
+        }
+    }
+
+    // The cached untracked names of dir, if its mtime is still the one they
+    // were recorded at and that mtime is older than the index itself
+    const UntrackedDir *cachedUntracked(const string &dir, int64_t sec, int64_t nsec) const
+    {
+        auto it = untrackedCache.find(dir);
+        if (it == untrackedCache.end() || it->second.mtimeSec != sec || it->second.mtimeNsec != nsec)
+            return nullptr;
+        return isRacyTime(sec, nsec) ? nullptr : &it->second;
+    }
+
+    // Whether something stamped with this mtime may have changed again in the
+    // same instant the index was written
+    bool isRacyTime(int64_t sec, int64_t nsec) const
+    {
+        return sec > mtimeSec || (sec == mtimeSec && nsec >= mtimeNsec);
+    }
+
+    // Forgets the cached trees and untracked lists of every directory that
+    // contains filepath
+    void invalidate(string_view filepath)
+    {
+        size_t slash = filepath.rfind('/');
+        while (slash != string_view::npos && slash > 0)
+        {
+            auto node = cacheTree.find(string(filepath.substr(0, slash)));
+            if (node != cacheTree.end())
+                cacheTree.erase(node);
+            auto untracked = untrackedCache.find(string(filepath.substr(0, slash + 1)));
+            if (untracked != untrackedCache.end())
+                untrackedCache.erase(untracked);
+            slash = filepath.rfind('/', slash - 1);
+        }
+        cacheTree.erase("");
+        untrackedCache.erase("");
+    }
+
+    // An entry can be trusted without reading the file when its stat data still
+    // matches, unless the file was modified in the same instant the index was
+    // written: such an entry may hide a later change with identical stat data.
+    // A recorded size of 0 is never trusted, since save() smudges racy entries
+    // that way.
+    bool isStatClean(const Metadata &entry, const struct stat &st) const
+    {
+        if (entry.mtimeSec != st.st_mtim.tv_sec || entry.mtimeNsec != st.st_mtim.tv_nsec ||
+            entry.ctimeSec != st.st_ctim.tv_sec || entry.ctimeNsec != st.st_ctim.tv_nsec ||
+            entry.dev != static_cast<uint64_t>(st.st_dev) || entry.ino != st.st_ino ||
+            entry.size != static_cast<uint64_t>(st.st_size) || entry.size == 0)
+            return false;
+        return !isRacy(entry);
+    }
+
+    bool save()
+    {
+        sort(entries.begin(), entries.end(), [](const Metadata &a, const Metadata &b)
+             { return a.path < b.path; });
+        sortedCount = entries.size();
+        addedPositions.clear();
+        for (const Metadata &entry : entries)
+        {
+            if (!entry.removed && entry.path.size() > 0xffff)
+            {
+                cerr << "ERR: Path too long for the index: " << entry.path.substr(0, 64) << "...\n";
+                return false;
+            }
+        }
+
+        if (lockFd < 0 && !lock())
+            return false;
+        // The new index is stamped no earlier than its lock file, touched now.
+        // An entry modified at or after that instant, or racy in the loaded
+        // index, would look clean next time, so its size is zeroed to force a
+        // rehash.
+        struct stat lockStat;
+        futimens(lockFd, nullptr);
+        fstat(lockFd, &lockStat);
+        auto smudged = [&](const Metadata &entry)
+        {
+            return isRacy(entry) || entry.mtimeSec > lockStat.st_mtim.tv_sec ||
+                   (entry.mtimeSec == lockStat.st_mtim.tv_sec && entry.mtimeNsec >= lockStat.st_mtim.tv_nsec);
+        };
+
+        string data = INDEX_SIGNATURE;
+        putBigEndian(data, INDEX_VERSION, 4);
+        size_t countPos = data.size();
+        putBigEndian(data, 0, 4);
+        uint32_t count = 0;
+        for (const Metadata &entry : entries)
+        {
+            if (entry.removed)
+                continue;
+            putBigEndian(data, entry.ctimeSec, 8);
+            putBigEndian(data, entry.ctimeNsec, 4);
+            putBigEndian(data, entry.mtimeSec, 8);
+            putBigEndian(data, entry.mtimeNsec, 4);
+            putBigEndian(data, entry.dev, 8);
+            putBigEndian(data, entry.ino, 8);
+            putBigEndian(data, smudged(entry) ? 0 : entry.size, 8);
+            putBigEndian(data, entry.mode, 4);
+            data.append(reinterpret_cast<const char *>(entry.sha.hash), SHA_DIGEST_LENGTH);
+            putBigEndian(data, entry.path.size(), 2);
+            data.append(entry.path);
+            count++;
+        }
+        for (int i = 0; i < 4; i++)
+            data[countPos + i] = static_cast<char>(count >> (24 - 8 * i));
+
+        if (hasCacheTree || !cacheTree.empty())
+        {
+            string extension;
+            for (auto &[dir, node] : cacheTree)
+            {
+                putBigEndian(extension, dir.size(), 2);
+                extension += dir;
+                putBigEndian(extension, node.entryCount, 4);
+                extension.append(reinterpret_cast<const char *>(node.id.hash), SHA_DIGEST_LENGTH);
+            }
+            data += INDEX_EXT_CACHE_TREE;
+            putBigEndian(data, extension.size(), 4);
+            data += extension;
+        }
+        if (!untrackedCache.empty())
+        {
+            string extension;
+            for (auto &[dir, untracked] : untrackedCache)
+            {
+                putBigEndian(extension, dir.size(), 2);
+                extension += dir;
+                putBigEndian(extension, untracked.mtimeSec, 8);
+                putBigEndian(extension, untracked.mtimeNsec, 4);
+                putBigEndian(extension, untracked.names.size(), 4);
+                for (const string &name : untracked.names)
+                {
+                    putBigEndian(extension, name.size(), 2);
+                    extension += name;
+                }
+            }
+            data += INDEX_EXT_UNTRACKED;
+            putBigEndian(data, extension.size(), 4);
+            data += extension;
+        }
+        if (!untrackedContents.empty())
+        {
+            string extension;
+            for (auto &[dir, contents] : untrackedContents)
+            {
+                putBigEndian(extension, dir.size(), 2);
+                extension += dir;
+                extension.push_back(contents.hasFiles ? 1 : 0);
+                putBigEndian(extension, contents.stamps.size(), 4);
+                for (const DirStamp &stamp : contents.stamps)
+                {
+                    putBigEndian(extension, stamp.path.size(), 2);
+                    extension += stamp.path;
+                    putBigEndian(extension, stamp.mtimeSec, 8);
+                    putBigEndian(extension, stamp.mtimeNsec, 4);
+                }
+            }
+            data += INDEX_EXT_UNTRACKED_CONTENTS;
+            putBigEndian(data, extension.size(), 4);
+            data += extension;
+        }
+        if (!fsmonitorToken.empty())
+        {
+            string extension = fsmonitorToken + '\0';
+            for (const string &dirty : fsmonitorDirty)
+                extension += dirty + '\0';
+            data += INDEX_EXT_FSMONITOR;
+            putBigEndian(data, extension.size(), 4);
+            data += extension;
+        }
+
+        unsigned char checksum[SHA_DIGEST_LENGTH];
+        SHA1(reinterpret_cast<const unsigned char *>(data.data()), data.size(), checksum);
+        data.append(reinterpret_cast<const char *>(checksum), SHA_DIGEST_LENGTH);
+
+        bool written = ::write(lockFd, data.data(), data.size()) == static_cast<ssize_t>(data.size());
+        close(lockFd);
+        lockFd = -1;
+        if (!written || rename(".mygit/index.lock", ".mygit/index") != 0)
+        {
+            cerr << "ERR: Cannot write index\n";
+            unlink(".mygit/index.lock");
+            return false;
+        }
+        return true;
+    }
+
+private:
+    char *mapped = nullptr;
+    size_t mappedSize = 0;
+    int lockFd = -1;
+    size_t sortedCount = 0;
+    deque<string> ownedPaths;
+    unordered_map<string_view, size_t> addedPositions;
+    // mtime of .mygit/index when it was loaded, used to detect racily clean entries
+    int64_t mtimeSec = 0;
+    int64_t mtimeNsec = 0;
+
+    // Whether entry was modified no earlier than the loaded index was written
+    bool isRacy(const Metadata &entry) const
+    {
+        if (mtimeSec == 0 && mtimeNsec == 0)
+            return false;
+        return isRacyTime(entry.mtimeSec, entry.mtimeNsec);
+    }
+
+    bool parseBinary()
+    {
+        if (getBigEndian(mapped + 4, 4) != INDEX_VERSION)
+        {
+            cerr << "ERR: Unsupported index version\n";
+            return false;
+        }
+
+        if (mappedSize < 12 + SHA_DIGEST_LENGTH || !hasValidChecksum(mapped, mappedSize))
+        {
+            cerr << "ERR: Index checksum mismatch, .mygit/index is corrupt\n";
+            return false;
+        }
+
+        uint32_t count = getBigEndian(mapped + 8, 4);
+        const char *pos = mapped + 12;
+        const char *end = mapped + mappedSize - SHA_DIGEST_LENGTH;
+        entries.reserve(count);
+        for (uint32_t i = 0; i < count; i++)
+        {
+            if (pos + INDEX_ENTRY_FIXED > end)
+            {
+                cerr << "ERR: Index file is truncated\n";
+                entries.clear();
+                return false;
+            }
+
+            Metadata entry;
+            entry.ctimeSec = getBigEndian(pos, 8);
+            entry.ctimeNsec = getBigEndian(pos + 8, 4);
+            entry.mtimeSec = getBigEndian(pos + 12, 8);
+            entry.mtimeNsec = getBigEndian(pos + 20, 4);
+            entry.dev = getBigEndian(pos + 24, 8);
+            entry.ino = getBigEndian(pos + 32, 8);
+            entry.size = getBigEndian(pos + 40, 8);
+            entry.mode = getBigEndian(pos + 48, 4);
+            entry.sha = ObjectId::fromRaw(pos + 52);
+            size_t pathLen = getBigEndian(pos + 72, 2);
+            pos += INDEX_ENTRY_FIXED;
+            if (pos + pathLen > end)
+            {
+                cerr << "ERR: Index file is truncated\n";
+                entries.clear();
+                return false;
+            }
+            entry.path = string_view(pos, pathLen);
+            pos += pathLen;
+            entries.push_back(entry);
+        }
+        sortedCount = entries.size();
+
+        while (pos + 8 <= end)
+        {
+            size_t size = getBigEndian(pos + 4, 4);
+            if (pos + 8 + size > end)
+                break;
+            if (memcmp(pos, INDEX_EXT_CACHE_TREE, 4) == 0)
+                parseCacheTree(pos + 8, pos + 8 + size);
+            else if (memcmp(pos, INDEX_EXT_FSMONITOR, 4) == 0)
+                parseFsmonitor(pos + 8, pos + 8 + size);
+            else if (memcmp(pos, INDEX_EXT_UNTRACKED, 4) == 0)
+                parseUntracked(pos + 8, pos + 8 + size);
+            else if (memcmp(pos, INDEX_EXT_UNTRACKED_CONTENTS, 4) == 0)
+                parseUntrackedContents(pos + 8, pos + 8 + size);
+            pos += 8 + size;
+        }
+        return true;
+    }
+
+    void parseUntracked(const char *pos, const char *end)
+    {
+        while (pos + 2 <= end)
+        {
+            size_t dirLen = getBigEndian(pos, 2);
+            if (pos + 2 + dirLen + 16 > end)
+                break;
+            string dir(pos + 2, dirLen);
+            pos += 2 + dirLen;
+            UntrackedDir untracked;
+            untracked.mtimeSec = getBigEndian(pos, 8);
+            untracked.mtimeNsec = getBigEndian(pos + 8, 4);
+            uint32_t count = getBigEndian(pos + 12, 4);
+            pos += 16;
+            for (uint32_t i = 0; i < count && pos + 2 <= end; i++)
+            {
+                size_t nameLen = getBigEndian(pos, 2);
+                if (pos + 2 + nameLen > end)
+                    return;
+                untracked.names.emplace_back(pos + 2, nameLen);
+                pos += 2 + nameLen;
+            }
+            untrackedCache[dir] = move(untracked);
+        }
+    }
+
+    // Per directory: its path, a has-files byte and a stamp count, then each
+    // stamp's path and mtime
+    void parseUntrackedContents(const char *pos, const char *end)
+    {
+        while (pos + 2 <= end)
+        {
+            size_t dirLen = getBigEndian(pos, 2);
+            if (pos + 2 + dirLen + 5 > end)
+                break;
+            string dir(pos + 2, dirLen);
+            pos += 2 + dirLen;
+            UntrackedContents contents;
+            contents.hasFiles = *pos != 0;
+            uint32_t count = getBigEndian(pos + 1, 4);
+            pos += 5;
+            for (uint32_t i = 0; i < count; i++)
+            {
+                if (pos + 2 > end)
+                    return;
+                size_t pathLen = getBigEndian(pos, 2);
+                if (pos + 2 + pathLen + 12 > end)
+                    return;
+                DirStamp stamp;
+                stamp.path.assign(pos + 2, pathLen);
+                stamp.mtimeSec = getBigEndian(pos + 2 + pathLen, 8);
+                stamp.mtimeNsec = getBigEndian(pos + 2 + pathLen + 8, 4);
+                contents.stamps.push_back(move(stamp));
+                pos += 2 + pathLen + 12;
+            }
+            untrackedContents[dir] = move(contents);
+        }
+    }
+
+    // The token, then the dirty paths, each terminated by a NUL
+    void parseFsmonitor(const char *pos, const char *end)
+    {
+        const char *nul = static_cast<const char *>(memchr(pos, '\0', end - pos));
+        if (!nul)
+            return;
+        fsmonitorToken.assign(pos, nul);
+        for (pos = nul + 1; pos < end; pos = nul + 1)
+        {
+            nul = static_cast<const char *>(memchr(pos, '\0', end - pos));
+            if (!nul)
+                break;
+            fsmonitorDirty.emplace_back(pos, nul);
+        }
+    }
+
+    void parseCacheTree(const char *pos, const char *end)
+    {
+        hasCacheTree = true;
+        while (pos + 2 <= end)
+        {
+            size_t dirLen = getBigEndian(pos, 2);
+            if (pos + 2 + dirLen + 4 + SHA_DIGEST_LENGTH > end)
+                break;
+            CacheTreeNode &node = cacheTree[string(pos + 2, dirLen)];
+            pos += 2 + dirLen;
+            node.entryCount = getBigEndian(pos, 4);
+            node.id = ObjectId::fromRaw(pos + 4);
+            pos += 4 + SHA_DIGEST_LENGTH;
+        }
+    }
+
+    // Text index written by older versions: "type sha [stat fields] path"
+    bool parseText()
+    {
+        istringstream ss(string(mapped, mappedSize));
+        string line;
+        while (getline(ss, line))
+        {
+            istringstream lineStream(line);
+            vector<string> fields;
+            string field;
+            while (lineStream >> field)
+                fields.push_back(field);
+            if ((fields.size() != 10 && fields.size() != 3) || fields[0] != "blob")
+                continue;
+            // Directories were once staged as a single entry
+            if (is_directory(fields.back()))
+                continue;
+
+            Metadata &entry = upsert(fields.back());
+            if (!ObjectId::fromHex(fields[1], entry.sha))
+            {
+                entry.removed = true;
+                continue;
+            }
+            if (fields.size() == 10)
+            {
+                entry.ctimeSec = stoll(fields[2]);
+                entry.ctimeNsec = stoll(fields[3]);
+                entry.mtimeSec = stoll(fields[4]);
+                entry.mtimeNsec = stoll(fields[5]);
+                entry.dev = stoull(fields[6]);
+                entry.ino = stoull(fields[7]);
+                entry.size = stoull(fields[8]);
+            }
+        }
+        return true;
+    }
+};
+
+// The path as the index stores it: normalized, relative, without a trailing
+// '/'. The work tree root is ".".
+string indexPath(path filepath)
+{
+    string name = filepath.lexically_normal().string();
+    if (name.size() > 2 && name.compare(0, 2, "./") == 0)
+        name = name.substr(2);
+    while (name.size() > 1 && name.back() == '/')
+        name.pop_back();
+    return name.empty() ? "." : name;
+}
+
+#define FSMONITOR_SOCKET ".mygit/fsmonitor.sock"
+
+// Paths the fsmonitor daemon reported changed since the index's token, plus
+// the ones the index still had marked dirty. A path counts as changed when it
+// or one of its directories is listed.
+struct FsmonitorChanges
+{
+    // token to store in the index once these changes have been looked at
+    string token;
+    // the daemon could not tell; everything has to be checked
+    bool full = false;
+    deque<string> storage;
+    unordered_set<string_view> paths;
+
+    void insert(string_view filepath)
+    {
+        storage.emplace_back(filepath);
+        paths.insert(storage.back());
+    }
+
+    bool contains(string_view filepath) const
+    {
+        if (full)
+            return true;
+        while (true)
+        {
+            if (paths.count(filepath))
+                return true;
+            size_t slash = filepath.rfind('/');
+            if (slash == string_view::npos)
+                return false;
+            filepath = filepath.substr(0, slash);
+        }
+    }
+};
+
+int connectFsmonitor()
+{
+    int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd < 0)
+        return -1;
+    sockaddr_un address = {};
+    address.sun_family = AF_UNIX;
+    strncpy(address.sun_path, FSMONITOR_SOCKET, sizeof(address.sun_path) - 1);
+    if (connect(fd, reinterpret_cast<sockaddr *>(&address), sizeof(address)) != 0)
+    {
+        close(fd);
+        return -1;
+    }
+    timeval timeout = {2, 0};
+    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+    return fd;
+}
+
+// Asks the fsmonitor daemon what changed since the index's token. Returns
+// false when no daemon answers, in which case callers check every path.
+bool queryFsmonitor(const Index &index, FsmonitorChanges &changes)
+{
+    int fd = connectFsmonitor();
+    if (fd < 0)
+        return false;
+
+    string request = index.fsmonitorToken + '\n';
+    bool sent = send(fd, request.data(), request.size(), MSG_NOSIGNAL) == static_cast<ssize_t>(request.size());
+    string reply;
+    char buffer[BUFFER_SIZE];
+    ssize_t bytesRead = 0;
+    while (sent && (bytesRead = read(fd, buffer, sizeof(buffer))) > 0)
+        reply.append(buffer, bytesRead);
+    close(fd);
+    size_t nul = reply.find('\0');
+    if (!sent || bytesRead < 0 || nul == string::npos)
+        return false;
+
+    changes.token = reply.substr(0, nul);
+    for (size_t pos = nul + 1; pos < reply.size(); pos = nul + 1)
+    {
+        nul = reply.find('\0', pos);
+        if (nul == string::npos)
+            break;
+        string_view changed = string_view(reply).substr(pos, nul - pos);
+        if (changed == "/")
+            changes.full = true;
+        else
+            changes.insert(changed);
+    }
+    for (const string &dirty : index.fsmonitorDirty)
+        changes.insert(dirty);
+    return true;
+}
+
+// Whether filepath is dir or lies under it ("." covers everything)
+bool isWithin(string_view filepath, const string &dir)
+{
+    return dir == "." || (filepath.compare(0, dir.size(), dir) == 0 &&
+                          (filepath.size() == dir.size() || filepath[dir.size()] == '/'));
+}
+
+// What staging one file found: a new id and stat data for its entry, unless
+// the entry is already up to date (or the file could not be read)
+struct StagedFile
+{
+    string name;
+    bool changed = false;
+    ObjectId sha;
+    struct stat st = {};
+};
+
+// Stats and hashes one file without modifying the index, so files can be
+// examined as pool tasks while the index is only read
+StagedFile examineFile(const string &name, const Index &index, const FsmonitorChanges *changes)
+{
+    StagedFile file;
+    file.name = name;
+    // Nothing happened to the file since the entry was last known good
+    const Metadata *cached = index.find(name);
+    if (changes && cached && !cached->removed && !changes->contains(name))
+        return file;
+
+    if (lstat(name.c_str(), &file.st) != 0)
+    {
+        cerr << "ERR: Cannot stat file " << name << '\n';
+        return file;
+    }
+    if (cached && !cached->removed && index.isStatClean(*cached, file.st))
+        return file;
+
+    file.sha = hashObject(name, true);
+    file.changed = !file.sha.isNull();
+    return file;
+}
+
+void stageFile(Index &index, const StagedFile &file)
+{
+    if (!file.changed)
+        return;
+    Metadata *cached = index.find(file.name);
+    if (!cached || cached->removed || cached->sha != file.sha)
+        index.invalidate(file.name);
+    Metadata &entry = index.upsert(file.name);
+    entry.sha = file.sha;
+    entry.mode = 0100644;
+    fillStat(entry, file.st);
+}
+
+void processFile(path &filepath, Index &index, const FsmonitorChanges *changes = nullptr)
+{
+    stageFile(index, examineFile(indexPath(filepath), index, changes));
+}
+
+// Files are examined in parallel on the work pool, then staged one by one on
+// the calling thread
+void stageFiles(const vector<string> &names, Index &index, const FsmonitorChanges *changes)
+{
+    ThreadPool &pool = workPool();
+    vector<future<StagedFile>> pending;
+    for (const string &name : names)
+    {
+        pending.push_back(pool.submit([&name, &index, changes]
+                                      { return examineFile(name, index, changes); }));
+    }
+    // The tasks read the index, so nothing is staged until all have finished
+    vector<StagedFile> files;
+    for (auto &file : pending)
+        files.push_back(pool.wait(file));
+    for (const StagedFile &file : files)
+        stageFile(index, file);
+}
+
+void collectDirectoryFiles(const path &dirpath, vector<string> &names)
+{
+    for (auto it = recursive_directory_iterator(dirpath); it != recursive_directory_iterator(); ++it)
+    {
+        if (it->is_directory())
+        {
+            if (it->path().filename() == ".mygit" || it->path().filename() == ".git")
+                it.disable_recursion_pending();
+            continue;
+        }
+        if (it->is_regular_file())
+            names.push_back(indexPath(it->path()));
+    }
+}
+
+// Stages every file under dirpath. With a list of changes from the fsmonitor
+// daemon only the changed paths under it are looked at, and a changed
+// directory among them is walked; a full list walks all of dirpath.
+void processDirectory(path &dirpath, Index &index, const FsmonitorChanges *changes = nullptr)
+{
+    vector<string> names;
+    string dir = indexPath(dirpath);
+    if (!changes || changes->contains(dir))
+    {
+        collectDirectoryFiles(dirpath, names);
+        stageFiles(names, index, changes);
+        return;
+    }
+
+    for (string_view changed : changes->paths)
+    {
+        if (!isWithin(changed, dir))
+            continue;
+        string name(changed);
+        path filepath(name);
+        if (any_of(filepath.begin(), filepath.end(), [](const path &part)
+                   { return part == ".mygit" || part == ".git"; }))
+            continue;
+        struct stat st;
+        if (lstat(name.c_str(), &st) != 0)
+            continue;
+        if (S_ISDIR(st.st_mode))
+            collectDirectoryFiles(filepath, names);
+        else if (S_ISREG(st.st_mode))
+            names.push_back(name);
+    }
+    // A changed file inside a changed directory is found twice
+    sort(names.begin(), names.end());
+    names.erase(unique(names.begin(), names.end()), names.end());
+    stageFiles(names, index, changes);
+}
+
+void detecteDeletions(Index &index, const FsmonitorChanges *changes = nullptr)
+{
+    for (Metadata &entry : index.entries)
+    {
+        if (entry.removed || (changes && !changes->contains(entry.path)))
+            continue;
+        if (!exists(path(entry.path)))
+        {
+            // cout << "Removing deleted file from index: " << entry.path << "\n";
+            entry.removed = true;
+            index.invalidate(entry.path);
+        }
+    }
+}
+
+#define MERGE_HEAD ".mygit/MERGE_HEAD"
+#define MERGE_CONFLICTS ".mygit/MERGE_CONFLICTS"
+
+// Paths a merge left conflicted that have not been added since, one per line
+vector<string> readMergeConflicts()
+{
+    vector<string> conflicts;
+    ifstream conflictsFile(MERGE_CONFLICTS);
+    string line;
+    while (getline(conflictsFile, line))
+    {
+        if (!line.empty())
+            conflicts.push_back(line);
+    }
+    return conflicts;
+}
+
+bool writeMergeConflicts(const vector<string> &conflicts)
+{
+    if (conflicts.empty())
+        return unlink(MERGE_CONFLICTS) == 0 || errno == ENOENT;
+    ofstream conflictsFile(MERGE_CONFLICTS, ios::trunc);
+    for (const string &name : conflicts)
+        conflictsFile << name << '\n';
+    conflictsFile.close();
+    if (!conflictsFile)
+    {
+        cerr << "ERR: Cannot write " << MERGE_CONFLICTS << '\n';
+        return false;
+    }
+    return true;
+}
+
+int add(vector<string> &files)
+{
+    Index index;
+    if (!index.lock() || !index.load())
+        return 1;
+    // With an fsmonitor daemon running, staged files it saw no change to are skipped
+    FsmonitorChanges changes;
+    bool monitored = queryFsmonitor(index, changes);
+    const FsmonitorChanges *changed = monitored ? &changes : nullptr;
+
+    vector<string> added;
+    for (const auto &file : files)
+    {
+        path filepath(file);
+        if (exists(filepath))
+        {
+            added.push_back(indexPath(filepath));
+            if (is_directory(filepath))
+            {
+                if (filepath.filename() == ".mygit")
+                    continue;
+                processDirectory(filepath, index, changed);
+            }
+            else if (is_regular_file(filepath))
+            {
+                processFile(filepath, index, changed);
+            }
+        }
+        else
+        {
+            // TODO: raise as errror
+            cerr << "ERR: File not found " << file << '\n';
+            continue;
+        }
+    }
+
+    detecteDeletions(index, changed);
+
+    // Changes outside the added paths have not been looked at yet, so they
+    // stay dirty under the new token. Without a list of changes the token can
+    // only move on when everything was added.
+    bool everything = find(added.begin(), added.end(), ".") != added.end();
+    if (monitored && (!changes.full || everything))
+    {
+        index.fsmonitorToken = changes.token;
+        index.fsmonitorDirty.clear();
+        for (string_view changedPath : changes.paths)
+        {
+            bool covered = any_of(added.begin(), added.end(), [changedPath](const string &name)
+                                  { return isWithin(changedPath, name); });
+            if (!covered)
+                index.fsmonitorDirty.emplace_back(changedPath);
+        }
+    }
+    if (!index.save())
+        return 1;
+
+    // Adding a conflicted path marks it resolved
+    vector<string> conflicts = readMergeConflicts();
+    size_t before = conflicts.size();
+    conflicts.erase(remove_if(conflicts.begin(), conflicts.end(), [&added](const string &name)
+                              { return any_of(added.begin(), added.end(), [&name](const string &dir)
+                                              { return isWithin(name, dir); }); }),
+                    conflicts.end());
+    if (conflicts.size() != before && !writeMergeConflicts(conflicts))
+        return 1;
+    return 0;
+}
+
+void collectTreeFiles(const ObjectId &treeSha, const string &prefix, map<string, TreeEntry> &files)
+{
+    string treeData = getObjData(treeSha);
+    for (const TreeItem &item : TreeView(treeData))
+    {
+        if (item.isTree())
+            collectTreeFiles(item.id, prefix + string(item.name) + "/", files);
+        else
+            files[prefix + string(item.name)] = toTreeEntry(item);
+    }
+}
+
+// Writes the tree for the staged entries in [begin, end), which all lie under
+// dir ("" or "a/b/"), and returns its id. A directory whose cache-tree node is
+// still valid is reused as is, so only the directories along changed paths
+// are written again.
+ObjectId writeIndexTree(Index &index, vector<const Metadata *>::iterator begin, vector<const Metadata *>::iterator end, const string &dir)
+{
+    string key = dir.empty() ? "" : dir.substr(0, dir.size() - 1);
+    uint32_t count = end - begin;
+    auto cached = index.cacheTree.find(key);
+    if (cached != index.cacheTree.end() && cached->second.entryCount == count)
+        return cached->second.id;
+
+    vector<TreeEntry> entries;
+    auto it = begin;
+    while (it != end)
+    {
+        string_view name = (*it)->path.substr(dir.size());
+        size_t slash = name.find('/');
+        if (slash == string_view::npos)
+        {
+            entries.push_back({"100644", string(name), "blob", (*it)->sha});
+            ++it;
+            continue;
+        }
+
+        string subdir = dir + string(name.substr(0, slash + 1));
+        auto dirEnd = it;
+        while (dirEnd != end && (*dirEnd)->path.compare(0, subdir.size(), subdir) == 0)
+            ++dirEnd;
+        ObjectId subtree = writeIndexTree(index, it, dirEnd, subdir);
+        if (subtree.isNull())
+            return ObjectId();
+        entries.push_back({"040000", string(name.substr(0, slash)), "tree", subtree});
+        it = dirEnd;
+    }
+
+    ObjectId tree = writeTreeEntries(entries);
+    if (!tree.isNull())
+        index.cacheTree[key] = {tree, count};
+    return tree;
+}
+
+ObjectId writeIndexTree(Index &index)
+{
+    vector<const Metadata *> staged;
+    for (const Metadata &entry : index.entries)
+    {
+        if (!entry.removed)
+            staged.push_back(&entry);
+    }
+    sort(staged.begin(), staged.end(), [](const Metadata *a, const Metadata *b)
+         { return a->path < b->path; });
+    return writeIndexTree(index, staged.begin(), staged.end(), "");
+}
+
+// string getCurrentTimestamp()
+// {
+//     time_t t = time(nullptr);
+//     char buf[100];
+//     strftime(buf, sizeof(buf), "%Y-%m-%d %H:%M:%S", localtime(&t));
+//     return buf;
+// }
+
+string getCurrentTimestamp()
+{
+    time_t t = time(nullptr);
+    struct tm *localTime = localtime(&t);
+
+    char buf[100];
+    strftime(buf, sizeof(buf), "%a %b %d %H:%M:%S %Y", localTime);
+
+    // Get the timezone offset in hours and minutes
+    int offset = static_cast<int>(localTime->tm_gmtoff / 60);
+    char timezone[6];
+    snprintf(timezone, sizeof(timezone), "%+03d%02d", offset / 60, abs(offset % 60));
+
+    ostringstream oss;
+    oss << buf << " " << timezone;
+    return oss.str();
+}
+
+// Records the index as a commit on the current branch. While a merge is in
+// progress the commit gets MERGE_HEAD as its second parent, which is
+// written after the first one in the parent field, separated by a space,
+// and is refused until every path in MERGE_CONFLICTS has been added.
+ObjectId commit(string &message)
+{
+    ifstream headFile(".mygit/HEAD");
+    string branchRef;
+    if (!headFile)
+    {
+        branchRef = "refs/heads/main";
+        ofstream headInit(".mygit/HEAD");
+        headInit << "ref: " << branchRef;
+        headInit.close();
+    }
+    else
+    {
+        getline(headFile, branchRef);
+        // A detached HEAD holds the commit id itself and moves with each commit
+        branchRef = branchRef.compare(0, 5, "ref: ") == 0 ? branchRef.substr(5) : "HEAD";
+    }
+    headFile.close();
+    bool isFirstCommit = !exists(".mygit/" + branchRef);
+    ObjectId treesha, parentSHA;
+    Index index;
+    if (!index.lock() || !index.load())
+        return ObjectId();
+    if (exists(MERGE_HEAD))
+    {
+        vector<string> conflicts = readMergeConflicts();
+        for (const string &name : conflicts)
+            cerr << "ERR: Unresolved merge conflict in " << name << '\n';
+        if (!conflicts.empty())
+        {
+            cerr << "ERR: Fix the conflicts and add them before committing\n";
+            return ObjectId();
+        }
+    }
+    if (isFirstCommit)
+    {
+        // todo: avoid unstaged files
+        // The first commit records the whole working tree, staging it on the way
+        path root = ".";
+        processDirectory(root, index);
+        detecteDeletions(index);
+        create_directories(".mygit/refs/heads");
+    }
+    else
+    {
+        ifstream branchFile(".mygit/" + branchRef);
+        string parentLine;
+        getline(branchFile, parentLine);
+        parentSHA = ObjectId::parse(parentLine);
+        // An index that no commit has written yet may not list the files of
+        // the parent commit; stage those that are still on disk
+        if (!index.hasCacheTree)
+        {
+            string commit_data = getObjData(parentSHA);
+            map<string, TreeEntry> parentFiles;
+            collectTreeFiles(extractTreeSHA(commit_data), "", parentFiles);
+            for (auto &[name, entry] : parentFiles)
+            {
+                if (!index.find(name) && exists(path(name)))
+                    index.upsert(name).sha = entry.filehash;
+            }
+        }
+    }
+
+    if (debugTrace)
+    {
+        for (const Metadata &entry : index.entries)
+        {
+            if (!entry.removed)
+                cerr << "name: " << entry.path << "  " << entry.sha << "\n";
+        }
+    }
+    treesha = writeIndexTree(index);
+    if (treesha.isNull() || !index.save())
+    {
+        cerr << "ERR: Failed to write commit tree\n";
+        return ObjectId();
+    }
+    string parents = parentSHA.isNull() ? "" : parentSHA.toHex();
+    // A pending merge adds its other commit as the second parent
+    ifstream mergeFile(MERGE_HEAD);
+    bool merging = mergeFile.is_open();
+    string mergeLine;
+    getline(mergeFile, mergeLine);
+    ObjectId mergeSHA;
+    if (merging && (!ObjectId::fromHex(mergeLine, mergeSHA) || !objectExists(mergeSHA)))
+        cerr << "ERR: Ignoring invalid " << MERGE_HEAD << '\n';
+    else if (merging && !parentSHA.isNull())
+        parents += " " + mergeSHA.toHex();
+
+    string timestamp = getCurrentTimestamp();
+    string commitData = user.name + '\0' +
+                        user.email + '\0' + treesha.toHex() + '\0' +
+                        parents + '\0' +
+                        timestamp + '\0' +
+                        message;
+
+    ObjectId commitSha = writeObject(commitData, "commit");
+    ofstream refFile(".mygit/" + branchRef, ios::trunc);
+    refFile << commitSha;
+    refFile.close();
+    if (merging)
+    {
+        unlink(MERGE_CONFLICTS);
+        unlink(MERGE_HEAD);
+    }
+    return commitSha;
+}
+
+struct CommitInfo
+{
+    ObjectId tree;
+    vector<ObjectId> parents;
+    // seconds since the epoch
+    int64_t timestamp = 0;
+    // 1 + the largest generation of the parents, 0 when not known
+    uint32_t generation = 0;
+};
+
+// Commit timestamps are stored as "Sat Oct 17 22:59:14 2026 +0000"
+int64_t parseTimestamp(const string &timestamp)
+{
+    struct tm parsed = {};
+    const char *rest = strptime(timestamp.c_str(), "%a %b %d %H:%M:%S %Y", &parsed);
+    if (!rest)
+        return 0;
+
+    int64_t seconds = timegm(&parsed);
+    int offset = atoi(rest);
+    int offsetMinutes = (abs(offset) / 100) * 60 + abs(offset) % 100;
+    return seconds - (offset < 0 ? -offsetMinutes : offsetMinutes) * 60;
+}
+
+bool parseCommit(const string &commitObject, CommitInfo &info)
+{
+    istringstream ss(commitObject);
+    string header, userName, userEmail, treeSHA, parentSHA, timestamp;
+    getline(ss, header, '\0');
+    if (header.compare(0, 7, "commit ") != 0)
+        return false;
+
+    getline(ss, userName, '\0');
+    getline(ss, userEmail, '\0');
+    getline(ss, treeSHA, '\0');
+    getline(ss, parentSHA, '\0');
+    getline(ss, timestamp, '\0');
+    info.tree = ObjectId::parse(treeSHA);
+    // A merge lists its parents separated by spaces
+    info.parents.clear();
+    istringstream parents(parentSHA);
+    string parent;
+    while (parents >> parent)
+        info.parents.push_back(ObjectId::parse(parent));
+    info.timestamp = parseTimestamp(timestamp);
+    info.generation = 0;
+    return true;
+}
+
+#define GRAPH_SIGNATURE "CGPH"
+#define GRAPH_VERSION 2
+#define GRAPH_PARENT_NONE 0xffffffffu
+// signature, version, commit count, 256 fanout counts
+#define GRAPH_HEADER (4 + 4 + 4 + 256 * 4)
+// tree id, two parent positions, generation, timestamp
+#define GRAPH_DATA_WIDTH (SHA_DIGEST_LENGTH + 4 + 4 + 4 + 8)
+
+// .mygit/objects/info/commit-graph, mapped read-only: "CGPH", version, commit
+// count, a 256-entry fanout, the sorted commit ids, then one fixed-width row
+// per commit (tree id, positions of up to two parents, generation number,
+// commit time) and a trailing SHA-1. History can be walked from the rows
+// alone, without inflating any commit object.
+// Version 2 adds changed-path Bloom filters between the rows and the checksum:
+// one cumulative 4-byte end offset per commit, then the filter bytes.
+class CommitGraph
+{
+public:
+    // Maps the graph if it is intact: checksum, fanout and, in version 2,
+    // Bloom filter offsets that stay inside the filter data
+    bool load()
+    {
+        data = mapFile(".mygit/objects/info/commit-graph", size);
+        if (!data)
+            return false;
+        string error = validate();
+        if (!error.empty())
+        {
+            cerr << "ERR: Ignoring commit-graph: " << error << '\n';
+            munmap(const_cast<char *>(data), size);
+            data = nullptr;
+            count = 0;
+            hasBlooms = false;
+            return false;
+        }
+        return true;
+    }
+
+    // Sets filter to the changed-path Bloom filter of the commit at pos, false
+    // if the graph has no filters
+    bool bloomFilter(uint32_t pos, const char *&filter, size_t &length) const
+    {
+        if (!hasBlooms)
+            return false;
+
+        const char *bloomIndex = rowAt(count);
+        uint32_t start = pos == 0 ? 0 : getBigEndian(bloomIndex + (pos - 1) * 4, 4);
+        uint32_t end = getBigEndian(bloomIndex + pos * 4, 4);
+        filter = bloomIndex + count * 4 + start;
+        length = end - start;
+        return true;
+    }
+
+    uint32_t commitCount() const
+    {
+        return count;
+    }
+
+    bool find(const ObjectId &id, uint32_t &pos) const
+    {
+        if (!data)
+            return false;
+
+        uint32_t lo = id.hash[0] == 0 ? 0 : getBigEndian(data + 12 + (id.hash[0] - 1) * 4, 4);
+        uint32_t hi = getBigEndian(data + 12 + id.hash[0] * 4, 4);
+        while (lo < hi)
+        {
+            uint32_t mid = lo + (hi - lo) / 2;
+            int cmp = memcmp(data + GRAPH_HEADER + mid * SHA_DIGEST_LENGTH, id.hash, SHA_DIGEST_LENGTH);
+            if (cmp == 0)
+            {
+                pos = mid;
+                return true;
+            }
+            if (cmp < 0)
+                lo = mid + 1;
+            else
+                hi = mid;
+        }
+        return false;
+    }
+
+    ObjectId idAt(uint32_t pos) const
+    {
+        return ObjectId::fromRaw(data + GRAPH_HEADER + pos * SHA_DIGEST_LENGTH);
+    }
+
+    void info(uint32_t pos, CommitInfo &commit) const
+    {
+        const char *row = rowAt(pos);
+        commit.tree = ObjectId::fromRaw(row);
+        commit.parents.clear();
+        for (int i = 0; i < 2; i++)
+        {
+            uint32_t parent = getBigEndian(row + SHA_DIGEST_LENGTH + 4 * i, 4);
+            if (parent != GRAPH_PARENT_NONE && parent < count)
+                commit.parents.push_back(idAt(parent));
+        }
+        commit.generation = getBigEndian(row + SHA_DIGEST_LENGTH + 8, 4);
+        commit.timestamp = static_cast<int64_t>(getBigEndian(row + SHA_DIGEST_LENGTH + 12, 8));
+    }
+
+private:
+    const char *data = nullptr;
+    size_t size = 0;
+    uint32_t count = 0;
+    bool hasBlooms = false;
+
+    const char *rowAt(uint32_t pos) const
+    {
+        return data + GRAPH_HEADER + count * SHA_DIGEST_LENGTH + pos * GRAPH_DATA_WIDTH;
+    }
+
+    string validate()
+    {
+        uint64_t version = size >= GRAPH_HEADER ? getBigEndian(data + 4, 4) : 0;
+        if (size < GRAPH_HEADER + SHA_DIGEST_LENGTH || memcmp(data, GRAPH_SIGNATURE, 4) != 0 ||
+            (version != 1 && version != GRAPH_VERSION))
+            return "bad header";
+        if (!hasValidChecksum(data, size))
+            return "checksum mismatch";
+        count = getBigEndian(data + 8, 4);
+        uint64_t rowsEnd = GRAPH_HEADER + static_cast<uint64_t>(count) * (SHA_DIGEST_LENGTH + GRAPH_DATA_WIDTH);
+        if (rowsEnd + SHA_DIGEST_LENGTH > size)
+            return "truncated";
+        for (int i = 1; i < 256; i++)
+        {
+            if (getBigEndian(data + 12 + i * 4, 4) < getBigEndian(data + 12 + (i - 1) * 4, 4))
+                return "fanout is not sorted";
+        }
+        if (getBigEndian(data + 12 + 255 * 4, 4) != count)
+            return "fanout does not match the commit count";
+        if (version < 2)
+            return "";
+
+        // End offsets into the filter data, which runs up to the checksum
+        uint64_t filtersStart = rowsEnd + static_cast<uint64_t>(count) * 4;
+        if (filtersStart + SHA_DIGEST_LENGTH > size)
+            return "truncated Bloom index";
+        uint64_t filtersSize = size - SHA_DIGEST_LENGTH - filtersStart;
+        const char *bloomIndex = rowAt(count);
+        uint32_t previous = 0;
+        for (uint32_t pos = 0; pos < count; pos++)
+        {
+            uint32_t end = getBigEndian(bloomIndex + pos * 4, 4);
+            if (end < previous || end > filtersSize)
+                return "bad Bloom filter offset";
+            previous = end;
+        }
+        hasBlooms = true;
+        return "";
+    }
+};
+
+const CommitGraph &commitGraph()
+{
+    static CommitGraph graph;
+    static once_flag loaded;
+    call_once(loaded, []
+              { graph.load(); });
+    return graph;
+}
+
+// Reads a commit from the commit-graph, falling back to the commit object
+bool lookupCommit(const ObjectId &sha, CommitInfo &info)
+{
+    uint32_t pos;
+    if (commitGraph().find(sha, pos))
+    {
+        commitGraph().info(pos, info);
+        return true;
+    }
+    return parseCommit(getObjData(sha), info);
+}
+
+// Tips of all branches, plus HEAD when it is detached
+vector<ObjectId> refTips()
+{
+    vector<ObjectId> tips;
+    ObjectId id;
+    error_code ec;
+    for (auto &ref : recursive_directory_iterator(".mygit/refs", ec))
+    {
+        if (!ref.is_regular_file())
+            continue;
+        ifstream refFile(ref.path());
+        string sha;
+        getline(refFile, sha);
+        if (ObjectId::fromHex(sha, id))
+            tips.push_back(id);
+    }
+
+    ifstream headFile(".mygit/HEAD");
+    string head;
+    getline(headFile, head);
+    if (ObjectId::fromHex(head, id))
+        tips.push_back(id);
+    return tips;
+}
+
+#define BLOOM_HASHES 7
+#define BLOOM_BITS_PER_ENTRY 10
+// Commits changing more paths than this get a single all-ones byte, which
+// matches every query
+#define BLOOM_MAX_PATHS 512
+
+uint32_t murmur3(const string &key, uint32_t seed)
+{
+    const uint32_t c1 = 0xcc9e2d51, c2 = 0x1b873593;
+    uint32_t hash = seed;
+    size_t blocks = key.size() / 4;
+    for (size_t i = 0; i < blocks; i++)
+    {
+        uint32_t k;
+        memcpy(&k, key.data() + 4 * i, 4);
+        k *= c1;
+        k = (k << 15) | (k >> 17);
+        k *= c2;
+        hash ^= k;
+        hash = (hash << 13) | (hash >> 19);
+        hash = hash * 5 + 0xe6546b64;
+    }
+
+    uint32_t k = 0;
+    const unsigned char *tail = reinterpret_cast<const unsigned char *>(key.data()) + 4 * blocks;
+    switch (key.size() & 3)
+    {
+    case 3:
+        k ^= tail[2] << 16;
+        [[fallthrough]];
+    case 2:
+        k ^= tail[1] << 8;
+        [[fallthrough]];
+    case 1:
+        k ^= tail[0];
+        k *= c1;
+        k = (k << 15) | (k >> 17);
+        k *= c2;
+        hash ^= k;
+    }
+
+    hash ^= key.size();
+    hash ^= hash >> 16;
+    hash *= 0x85ebca6b;
+    hash ^= hash >> 13;
+    hash *= 0xc2b2ae35;
+    hash ^= hash >> 16;
+    return hash;
+}
+
+// The BLOOM_HASHES bit positions (before the modulo) of a path
+vector<uint32_t> bloomKey(const string &filepath)
+{
+    uint32_t hash0 = murmur3(filepath, 0x293ae76f);
+    uint32_t hash1 = murmur3(filepath, 0x7e646e2c);
+    vector<uint32_t> key;
+    for (uint32_t i = 0; i < BLOOM_HASHES; i++)
+        key.push_back(hash0 + i * hash1);
+    return key;
+}
+
+bool bloomMaybeContains(const char *filter, size_t length, const vector<uint32_t> &key)
+{
+    if (length == 0)
+        return false;
+    for (uint32_t hash : key)
+    {
+        uint64_t bit = hash % (length * 8);
+        if (!(static_cast<unsigned char>(filter[bit / 8]) & (1 << (bit % 8))))
+            return false;
+    }
+    return true;
+}
+
+string buildBloomFilter(const vector<string> &paths)
+{
+    if (paths.size() > BLOOM_MAX_PATHS)
+        return string(1, static_cast<char>(0xff));
+
+    string filter((paths.size() * BLOOM_BITS_PER_ENTRY + 7) / 8, '\0');
+    for (const string &filepath : paths)
+    {
+        for (uint32_t hash : bloomKey(filepath))
+        {
+            uint64_t bit = hash % (filter.size() * 8);
+            filter[bit / 8] |= 1 << (bit % 8);
+        }
+    }
+    return filter;
+}
+
+void listTreePaths(const ObjectId &treeSha, const string &prefix, vector<string> &paths)
+{
+    string treeData = getObjData(treeSha);
+    for (const TreeItem &item : TreeView(treeData))
+    {
+        paths.push_back(prefix + string(item.name));
+        if (item.isTree())
+            listTreePaths(item.id, paths.back() + "/", paths);
+    }
+}
+
+// Paths whose entries differ between two trees (null id for a missing tree),
+// including every directory on the way to a changed file
+void changedTreePaths(const ObjectId &oldTree, const ObjectId &newTree, const string &prefix, vector<string> &paths)
+{
+    if (oldTree == newTree)
+        return;
+
+    string oldData = oldTree.isNull() ? "" : getObjData(oldTree);
+    string newData = newTree.isNull() ? "" : getObjData(newTree);
+    map<string_view, TreeItem> oldEntries, newEntries;
+    for (const TreeItem &item : TreeView(oldData))
+        oldEntries.emplace(item.name, item);
+    for (const TreeItem &item : TreeView(newData))
+        newEntries.emplace(item.name, item);
+
+    for (auto &[name, entry] : newEntries)
+    {
+        auto old = oldEntries.find(name);
+        ObjectId oldTreeSha = (old != oldEntries.end() && old->second.isTree()) ? old->second.id : ObjectId();
+        if (old != oldEntries.end() && old->second.id == entry.id && old->second.mode == entry.mode)
+            continue;
+
+        paths.push_back(prefix + string(name));
+        if (entry.isTree())
+            changedTreePaths(oldTreeSha, entry.id, paths.back() + "/", paths);
+        else if (!oldTreeSha.isNull())
+            listTreePaths(oldTreeSha, paths.back() + "/", paths);
+    }
+    for (auto &[name, entry] : oldEntries)
+    {
+        if (newEntries.count(name))
+            continue;
+        paths.push_back(prefix + string(name));
+        if (entry.isTree())
+            listTreePaths(entry.id, paths.back() + "/", paths);
+    }
+}
+
+// Id of the entry at filepath inside a tree, null if there is none
+ObjectId treeEntryId(const ObjectId &treeSha, const string &filepath)
+{
+    ObjectId current = treeSha;
+    size_t start = 0;
+    while (!current.isNull())
+    {
+        size_t slash = filepath.find('/', start);
+        string_view name = string_view(filepath).substr(start, slash == string::npos ? string::npos : slash - start);
+        ObjectId next;
+        string treeData = getObjData(current);
+        for (const TreeItem &item : TreeView(treeData))
+        {
+            if (item.name == name)
+            {
+                next = item.id;
+                if (slash != string::npos && !item.isTree())
+                    return ObjectId();
+                break;
+            }
+        }
+        if (slash == string::npos)
+            return next;
+        current = next;
+        start = slash + 1;
+    }
+    return ObjectId();
+}
+
+// A file that differs between two trees: 'A'dded, 'D'eleted or 'M'odified.
+// Rename detection turns pairs into 'R'enamed or 'C'opied from oldPath.
+struct TreeChange
+{
+    char status;
+    string path;
+    TreeMode oldMode = MODE_UNKNOWN;
+    TreeMode newMode = MODE_UNKNOWN;
+    ObjectId oldId;
+    ObjectId newId;
+    string oldPath;
+    int similarity = 0;
+};
+
+// Reads the entries of a tree (none for the null id) in tree order. The names
+// point into data.
+bool readTreeItems(const ObjectId &treeSha, string &data, vector<TreeItem> &items)
+{
+    items.clear();
+    if (treeSha.isNull())
+        return true;
+    data = getObjData(treeSha);
+    TreeView tree(data);
+    if (!tree.isValid())
+        return false;
+    for (const TreeItem &item : tree)
+        items.push_back(item);
+
+    // Trees written before entries were sorted can be in any order
+    auto less = [](const TreeItem &a, const TreeItem &b)
+    { return compareTreeNames(a.name, a.isTree(), b.name, b.isTree()) < 0; };
+    if (!is_sorted(items.begin(), items.end(), less))
+        sort(items.begin(), items.end(), less);
+    return true;
+}
+
+// Walks two trees (null for a missing one) together in tree order and calls
+// visit for every file that differs, in path order. Entries with equal ids are
+// skipped without being read, so the cost follows the number of changed
+// paths rather than the size of the trees.
+bool diffTrees(const ObjectId &oldTree, const ObjectId &newTree, const string &prefix,
+               const function<void(const TreeChange &)> &visit)
+{
+    if (oldTree == newTree)
+        return true;
+
+    string oldData, newData;
+    vector<TreeItem> oldItems, newItems;
+    if (!readTreeItems(oldTree, oldData, oldItems) || !readTreeItems(newTree, newData, newItems))
+    {
+        cerr << "ERR: Cannot read tree " << (oldTree.isNull() ? newTree : oldTree) << '\n';
+        return false;
+    }
+
+    bool ok = true;
+    auto report = [&](char status, const TreeItem *oldItem, const TreeItem *newItem)
+    {
+        const TreeItem &item = newItem ? *newItem : *oldItem;
+        string name = prefix + string(item.name);
+        if (item.isTree())
+        {
+            ok = diffTrees(oldItem ? oldItem->id : ObjectId(), newItem ? newItem->id : ObjectId(), name + "/", visit) && ok;
+            return;
+        }
+        TreeChange change;
+        change.status = status;
+        change.path = name;
+        if (oldItem)
+        {
+            change.oldMode = oldItem->mode;
+            change.oldId = oldItem->id;
+        }
+        if (newItem)
+        {
+            change.newMode = newItem->mode;
+            change.newId = newItem->id;
+        }
+        visit(change);
+    };
+
+    size_t i = 0, j = 0;
+    while (i < oldItems.size() || j < newItems.size())
+    {
+        int cmp = i == oldItems.size()   ? 1
+                  : j == newItems.size() ? -1
+                                         : compareTreeNames(oldItems[i].name, oldItems[i].isTree(), newItems[j].name, newItems[j].isTree());
+        if (cmp < 0)
+        {
+            report('D', &oldItems[i++], nullptr);
+        }
+        else if (cmp > 0)
+        {
+            report('A', nullptr, &newItems[j++]);
+        }
+        else
+        {
+            if (oldItems[i].id != newItems[j].id || oldItems[i].mode != newItems[j].mode)
+                report('M', &oldItems[i], &newItems[j]);
+            i++;
+            j++;
+        }
+    }
+    return ok;
+}
+
+#define SKETCH_SIZE 48
+#define SKETCH_BANDS 16
+#define SKETCH_ROWS (SKETCH_SIZE / SKETCH_BANDS)
+#define SKETCH_CHUNK 64
+#define SKETCH_CACHE ".mygit/sketches"
+#define SKETCH_SIGNATURE "SKCH"
+#define SKETCH_VERSION 1
+#define SKETCH_RECORD (SHA_DIGEST_LENGTH + SKETCH_SIZE * 4)
+#define RENAME_THRESHOLD 50
+#define RENAME_BUCKET_LIMIT 64
+
+// MinHash over the set of a blob's chunks: lines, cut every SKETCH_CHUNK
+// bytes. The fraction of equal minimums estimates how many chunks two blobs
+// share (their Jaccard similarity).
+struct Sketch
+{
+    uint32_t mins[SKETCH_SIZE];
+
+    bool isEmpty() const
+    {
+        return mins[0] == UINT32_MAX;
+    }
+
+    int similarity(const Sketch &other) const
+    {
+        int equal = 0;
+        for (int i = 0; i < SKETCH_SIZE; i++)
+            equal += mins[i] == other.mins[i];
+        return equal * 100 / SKETCH_SIZE;
+    }
+};
+
+uint64_t mixHash(uint64_t value)
+{
+    value ^= value >> 30;
+    value *= 0xbf58476d1ce4e5b9ULL;
+    value ^= value >> 27;
+    value *= 0x94d049bb133111ebULL;
+    return value ^ (value >> 31);
+}
+
+// Streams a blob and sketches its chunks without keeping the content
+bool computeSketch(const ObjectId &id, Sketch &sketch)
+{
+    fill(begin(sketch.mins), end(sketch.mins), UINT32_MAX);
+    ObjectReader reader;
+    if (!reader.open(id))
+        return false;
+
+    const uint64_t fnvOffset = 14695981039346656037ULL;
+    uint64_t hash = fnvOffset;
+    size_t length = 0;
+    auto addChunk = [&]()
+    {
+        uint64_t chunk = mixHash(hash + length);
+        for (int i = 0; i < SKETCH_SIZE; i++)
+            sketch.mins[i] = min(sketch.mins[i], static_cast<uint32_t>(mixHash(chunk + (i + 1) * 0x9e3779b97f4a7c15ULL)));
+        hash = fnvOffset;
+        length = 0;
+    };
+
+    char buffer[BUFFER_SIZE];
+    ssize_t bytesRead;
+    while ((bytesRead = reader.read(buffer, BUFFER_SIZE)) > 0)
+    {
+        for (ssize_t i = 0; i < bytesRead; i++)
+        {
+            hash = (hash ^ static_cast<unsigned char>(buffer[i])) * 1099511628211ULL;
+            if (++length == SKETCH_CHUNK || buffer[i] == '\n')
+                addChunk();
+        }
+    }
+    if (length > 0)
+        addChunk();
+    return bytesRead == 0;
+}
+
+// Sketches by blob id, kept in SKETCH_CACHE. Blobs never change, so records
+// are only ever appended.
+class SketchCache
+{
+public:
+    SketchCache()
+    {
+        ifstream file(SKETCH_CACHE, ios::binary);
+        string data((istreambuf_iterator<char>(file)), istreambuf_iterator<char>());
+        if (data.size() < 12 || data.compare(0, 4, SKETCH_SIGNATURE) != 0 ||
+            getBigEndian(data.data() + 4, 4) != SKETCH_VERSION || getBigEndian(data.data() + 8, 4) != SKETCH_SIZE)
+            return;
+
+        valid = true;
+        for (size_t pos = 12; pos + SKETCH_RECORD <= data.size(); pos += SKETCH_RECORD)
+        {
+            Sketch &sketch = sketches[ObjectId::fromRaw(reinterpret_cast<const unsigned char *>(data.data() + pos))];
+            for (int i = 0; i < SKETCH_SIZE; i++)
+                sketch.mins[i] = getBigEndian(data.data() + pos + SHA_DIGEST_LENGTH + i * 4, 4);
+        }
+    }
+
+    const Sketch *find(const ObjectId &id) const
+    {
+        auto it = sketches.find(id);
+        return it == sketches.end() ? nullptr : &it->second;
+    }
+
+    void add(const ObjectId &id, const Sketch &sketch)
+    {
+        sketches[id] = sketch;
+        added.push_back(id);
+    }
+
+    void save()
+    {
+        if (added.empty())
+            return;
+        string data;
+        if (!valid)
+        {
+            data = SKETCH_SIGNATURE;
+            putBigEndian(data, SKETCH_VERSION, 4);
+            putBigEndian(data, SKETCH_SIZE, 4);
+        }
+        for (const ObjectId &id : added)
+        {
+            data.append(reinterpret_cast<const char *>(id.hash), SHA_DIGEST_LENGTH);
+            for (uint32_t value : sketches[id].mins)
+                putBigEndian(data, value, 4);
+        }
+        ofstream file(SKETCH_CACHE, valid ? ios::binary | ios::app : ios::binary | ios::trunc);
+        file.write(data.data(), data.size());
+        valid = true;
+        added.clear();
+    }
+
+private:
+    unordered_map<ObjectId, Sketch, ObjectIdHash> sketches;
+    vector<ObjectId> added;
+    bool valid = false;
+};
+
+// The repository's sketch cache, read once per process
+SketchCache &sketchCache()
+{
+    static SketchCache cache;
+    return cache;
+}
+
+// Pairs deleted files with added ones as renames, and added files with
+// deleted or modified ones as copies. Identical blobs pair first. The rest
+// are sketched in parallel (sketches are cached per blob id). An LSH index
+// over bands of SKETCH_ROWS minimums proposes candidate pairs, so the cost
+// follows the number of similar pairs rather than deleted x added. Pairs
+// scoring at least RENAME_THRESHOLD are taken best first.
+void detectRenames(vector<TreeChange> &changes)
+{
+    vector<size_t> sources, targets;
+    bool anyDeleted = false;
+    for (size_t i = 0; i < changes.size(); i++)
+    {
+        if (changes[i].status == 'A')
+            targets.push_back(i);
+        else if (changes[i].status == 'D' || changes[i].status == 'M')
+            sources.push_back(i);
+        anyDeleted = anyDeleted || changes[i].status == 'D';
+    }
+    if (targets.empty() || !anyDeleted)
+        return;
+
+    struct Candidate
+    {
+        int score;
+        size_t source;
+        size_t target;
+    };
+    vector<Candidate> candidates;
+    // Identical blobs: each target takes the next deleted file with its id,
+    // and is a copy of the first one once they run out
+    unordered_map<ObjectId, pair<vector<size_t>, size_t>, ObjectIdHash> sourcesById;
+    for (char status : {'D', 'M'})
+    {
+        for (size_t source : sources)
+        {
+            if (changes[source].status == status)
+                sourcesById[changes[source].oldId].first.push_back(source);
+        }
+    }
+    vector<size_t> inexact;
+    for (size_t target : targets)
+    {
+        auto it = sourcesById.find(changes[target].newId);
+        if (it == sourcesById.end())
+        {
+            inexact.push_back(target);
+            continue;
+        }
+        vector<size_t> &list = it->second.first;
+        size_t &next = it->second.second;
+        bool unused = next < list.size() && changes[list[next]].status == 'D';
+        candidates.push_back({100, unused ? list[next++] : list[0], target});
+    }
+
+    if (!inexact.empty())
+    {
+        SketchCache &cache = sketchCache();
+        vector<ObjectId> missing;
+        unordered_set<ObjectId, ObjectIdHash> queued;
+        auto want = [&](const ObjectId &id)
+        {
+            if (!cache.find(id) && queued.insert(id).second)
+                missing.push_back(id);
+        };
+        for (size_t source : sources)
+            want(changes[source].oldId);
+        for (size_t target : inexact)
+            want(changes[target].newId);
+
+        ThreadPool &pool = workPool();
+        vector<future<pair<bool, Sketch>>> pending;
+        for (const ObjectId &id : missing)
+            pending.push_back(pool.submit([id]
+                                          {
+                Sketch sketch;
+                bool ok = computeSketch(id, sketch);
+                return make_pair(ok, sketch); }));
+        for (size_t i = 0; i < missing.size(); i++)
+        {
+            pair<bool, Sketch> result = pool.wait(pending[i]);
+            if (result.first)
+                cache.add(missing[i], result.second);
+        }
+        cache.save();
+
+        auto bandKey = [](const Sketch &sketch, int band)
+        {
+            uint64_t key = band;
+            for (int row = 0; row < SKETCH_ROWS; row++)
+                key = mixHash(key ^ sketch.mins[band * SKETCH_ROWS + row]);
+            return key;
+        };
+        unordered_map<uint64_t, vector<size_t>> buckets;
+        for (size_t source : sources)
+        {
+            const Sketch *sketch = cache.find(changes[source].oldId);
+            if (!sketch || sketch->isEmpty())
+                continue;
+            for (int band = 0; band < SKETCH_BANDS; band++)
+                buckets[bandKey(*sketch, band)].push_back(source);
+        }
+
+        unordered_set<size_t> compared;
+        for (size_t target : inexact)
+        {
+            const Sketch *sketch = cache.find(changes[target].newId);
+            if (!sketch || sketch->isEmpty())
+                continue;
+            compared.clear();
+            for (int band = 0; band < SKETCH_BANDS; band++)
+            {
+                auto it = buckets.find(bandKey(*sketch, band));
+                // Chunks shared by many files (boilerplate) say little
+                if (it == buckets.end() || it->second.size() > RENAME_BUCKET_LIMIT)
+                    continue;
+                for (size_t source : it->second)
+                {
+                    if (!compared.insert(source).second)
+                        continue;
+                    int score = sketch->similarity(*cache.find(changes[source].oldId));
+                    if (score >= RENAME_THRESHOLD)
+                        candidates.push_back({score, source, target});
+                }
+            }
+        }
+    }
+
+    // Best scores first; among equals a deleted source, then path order
+    sort(candidates.begin(), candidates.end(), [&](const Candidate &a, const Candidate &b)
+         {
+        if (a.score != b.score)
+            return a.score > b.score;
+        bool aDeleted = changes[a.source].status == 'D', bDeleted = changes[b.source].status == 'D';
+        if (aDeleted != bDeleted)
+            return aDeleted;
+        return make_pair(a.target, a.source) < make_pair(b.target, b.source); });
+
+    vector<char> renamed(changes.size(), 0), paired(changes.size(), 0);
+    vector<TreeChange> updated = changes;
+    for (const Candidate &candidate : candidates)
+    {
+        if (paired[candidate.target])
+            continue;
+        paired[candidate.target] = 1;
+        const TreeChange &source = changes[candidate.source];
+        TreeChange &target = updated[candidate.target];
+        bool rename = source.status == 'D' && !renamed[candidate.source];
+        if (rename)
+            renamed[candidate.source] = 1;
+        target.status = rename ? 'R' : 'C';
+        target.oldPath = source.path;
+        target.oldMode = source.oldMode;
+        target.oldId = source.oldId;
+        target.similarity = candidate.score;
+    }
+
+    changes.clear();
+    for (size_t i = 0; i < updated.size(); i++)
+    {
+        if (!renamed[i])
+            changes.push_back(move(updated[i]));
+    }
+}
+
+#define DIFF_CONTEXT 3
+#define BINARY_PROBE 8000
+
+// Splits content into lines that keep their '\n' (the last one may lack it)
+void splitLines(string_view content, vector<string_view> &lines)
+{
+    lines.clear();
+    lines.reserve(count(content.begin(), content.end(), '\n') + 1);
+    size_t start = 0;
+    while (start < content.size())
+    {
+        const char *newline = static_cast<const char *>(memchr(content.data() + start, '\n', content.size() - start));
+        size_t end = newline ? newline - content.data() + 1 : content.size();
+        lines.push_back(content.substr(start, end - start));
+        start = end;
+    }
+}
+
+// Linear-space Myers diff over interned line ids. Each step bisects the edit
+// graph at the middle of a shortest edit script and recurses on both halves;
+// lines that are not part of the common subsequence are marked changed.
+class MyersDiff
+{
+public:
+    MyersDiff(const vector<uint32_t> &a, const vector<uint32_t> &b, vector<char> &aChanged, vector<char> &bChanged)
+        : a(a), b(b), aChanged(aChanged), bChanged(bChanged)
+    {
+    }
+
+    void compare(size_t aLo, size_t aHi, size_t bLo, size_t bHi)
+    {
+        while (aLo < aHi && bLo < bHi && a[aLo] == b[bLo])
+        {
+            aLo++;
+            bLo++;
+        }
+        while (aLo < aHi && bLo < bHi && a[aHi - 1] == b[bHi - 1])
+        {
+            aHi--;
+            bHi--;
+        }
+
+        size_t aSplit, bSplit;
+        if (aLo == aHi || bLo == bHi || !bisect(aLo, aHi, bLo, bHi, aSplit, bSplit))
+        {
+            fill(aChanged.begin() + aLo, aChanged.begin() + aHi, 1);
+            fill(bChanged.begin() + bLo, bChanged.begin() + bHi, 1);
+            return;
+        }
+        compare(aLo, aSplit, bLo, bSplit);
+        compare(aSplit, aHi, bSplit, bHi);
+    }
+
+private:
+    const vector<uint32_t> &a;
+    const vector<uint32_t> &b;
+    vector<char> &aChanged;
+    vector<char> &bChanged;
+    vector<int64_t> forward;
+    vector<int64_t> backward;
+
+    // Runs the forward and backward searches until their paths overlap and
+    // returns the point where they meet. Like git, the search gives up after
+    // about sqrt(n + m) edits and splits at the furthest point the forward
+    // search reached, trading minimality for time on large inputs.
+    bool bisect(size_t aLo, size_t aHi, size_t bLo, size_t bHi, size_t &aSplit, size_t &bSplit)
+    {
+        int64_t n = aHi - aLo, m = bHi - bLo;
+        int64_t maxD = (n + m + 1) / 2;
+        int64_t maxCost = 256;
+        while (maxCost * maxCost < n + m)
+            maxCost *= 2;
+        maxD = min(maxD, maxCost);
+        int64_t offset = maxD, length = 2 * maxD + 2;
+        forward.assign(length, -1);
+        backward.assign(length, -1);
+        int64_t *v1 = forward.data(), *v2 = backward.data();
+        v1[offset + 1] = 0;
+        v2[offset + 1] = 0;
+
+        int64_t delta = n - m;
+        bool front = delta % 2 != 0;
+        // Diagonals whose paths ran off the graph are not searched again
+        int64_t k1start = 0, k1end = 0, k2start = 0, k2end = 0;
+        for (int64_t d = 0; d < maxD; d++)
+        {
+            for (int64_t k1 = -d + k1start; k1 <= d - k1end; k1 += 2)
+            {
+                int64_t k1Offset = offset + k1;
+                int64_t x1 = (k1 == -d || (k1 != d && v1[k1Offset - 1] < v1[k1Offset + 1])) ? v1[k1Offset + 1] : v1[k1Offset - 1] + 1;
+                int64_t y1 = x1 - k1;
+                while (x1 < n && y1 < m && a[aLo + x1] == b[bLo + y1])
+                {
+                    x1++;
+                    y1++;
+                }
+                v1[k1Offset] = x1;
+                if (x1 > n)
+                {
+                    k1end += 2;
+                }
+                else if (y1 > m)
+                {
+                    k1start += 2;
+                }
+                else if (front)
+                {
+                    int64_t k2Offset = offset + delta - k1;
+                    if (k2Offset >= 0 && k2Offset < length && v2[k2Offset] != -1 && x1 >= n - v2[k2Offset])
+                    {
+                        aSplit = aLo + x1;
+                        bSplit = bLo + y1;
+                        return true;
+                    }
+                }
+            }
+
+            for (int64_t k2 = -d + k2start; k2 <= d - k2end; k2 += 2)
+            {
+                int64_t k2Offset = offset + k2;
+                int64_t x2 = (k2 == -d || (k2 != d && v2[k2Offset - 1] < v2[k2Offset + 1])) ? v2[k2Offset + 1] : v2[k2Offset - 1] + 1;
+                int64_t y2 = x2 - k2;
+                while (x2 < n && y2 < m && a[aHi - 1 - x2] == b[bHi - 1 - y2])
+                {
+                    x2++;
+                    y2++;
+                }
+                v2[k2Offset] = x2;
+                if (x2 > n)
+                {
+                    k2end += 2;
+                }
+                else if (y2 > m)
+                {
+                    k2start += 2;
+                }
+                else if (!front)
+                {
+                    int64_t k1Offset = offset + delta - k2;
+                    if (k1Offset >= 0 && k1Offset < length && v1[k1Offset] != -1)
+                    {
+                        int64_t x1 = v1[k1Offset];
+                        int64_t y1 = offset + x1 - k1Offset;
+                        if (x1 >= n - x2)
+                        {
+                            aSplit = aLo + x1;
+                            bSplit = bLo + y1;
+                            return true;
+                        }
+                    }
+                }
+            }
+        }
+
+        int64_t best = -1;
+        for (int64_t k1 = -maxD; k1 <= maxD; k1++)
+        {
+            int64_t x1 = v1[offset + k1], y1 = x1 - k1;
+            if (x1 >= 0 && x1 <= n && y1 >= 0 && y1 <= m && x1 + y1 < n + m && x1 + y1 > best)
+            {
+                best = x1 + y1;
+                aSplit = aLo + x1;
+                bSplit = bLo + y1;
+            }
+        }
+        return best > 0;
+    }
+};
+
+// Maps equal lines to the same small integer. An open-addressing table of
+// line hashes avoids allocating a node per distinct line.
+class LineInterner
+{
+public:
+    explicit LineInterner(size_t lines)
+    {
+        size_t capacity = 16;
+        while (capacity < lines * 2)
+            capacity *= 2;
+        slots.assign(capacity, 0);
+        mask = capacity - 1;
+    }
+
+    uint32_t intern(string_view line)
+    {
+        uint64_t hash = std::hash<string_view>()(line);
+        for (size_t slot = hash & mask;; slot = (slot + 1) & mask)
+        {
+            uint32_t stored = slots[slot];
+            if (stored == 0)
+            {
+                distinct.push_back(line);
+                hashes.push_back(hash);
+                slots[slot] = distinct.size();
+                return distinct.size() - 1;
+            }
+            if (hashes[stored - 1] == hash && distinct[stored - 1] == line)
+                return stored - 1;
+        }
+    }
+
+    size_t size() const
+    {
+        return distinct.size();
+    }
+
+private:
+    vector<uint32_t> slots; // id + 1, 0 for an empty slot
+    size_t mask;
+    vector<string_view> distinct;
+    vector<uint64_t> hashes;
+};
+
+// A run of oldCount lines at oldStart replaced by newCount lines at newStart
+struct DiffEdit
+{
+    size_t oldStart;
+    size_t oldCount;
+    size_t newStart;
+    size_t newCount;
+};
+
+// Computes the edits turning oldLines into newLines. The common prefix and
+// suffix are trimmed first; the remaining lines are interned so the core
+// algorithm compares integers, and lines that occur on only one side are
+// dropped from it since they can never match.
+vector<DiffEdit> diffLines(const vector<string_view> &oldLines, const vector<string_view> &newLines)
+{
+    size_t n = oldLines.size(), m = newLines.size();
+    size_t prefix = 0, suffix = 0;
+    while (prefix < n && prefix < m && oldLines[prefix] == newLines[prefix])
+        prefix++;
+    while (suffix < n - prefix && suffix < m - prefix && oldLines[n - 1 - suffix] == newLines[m - 1 - suffix])
+        suffix++;
+
+    LineInterner interner(n + m - 2 * (prefix + suffix));
+    vector<uint32_t> oldIds, newIds;
+    vector<uint8_t> sides;
+    auto intern = [&](const vector<string_view> &lines, size_t end, vector<uint32_t> &ids, uint8_t side)
+    {
+        ids.reserve(end - prefix);
+        for (size_t i = prefix; i < end; i++)
+        {
+            uint32_t id = interner.intern(lines[i]);
+            if (id == sides.size())
+                sides.push_back(0);
+            sides[id] |= side;
+            ids.push_back(id);
+        }
+    };
+    intern(oldLines, n - suffix, oldIds, 1);
+    intern(newLines, m - suffix, newIds, 2);
+
+    vector<char> oldChanged(n, 0), newChanged(m, 0);
+    vector<uint32_t> a, b;
+    vector<size_t> aLines, bLines;
+    for (size_t i = 0; i < oldIds.size(); i++)
+    {
+        if (sides[oldIds[i]] == 3)
+        {
+            a.push_back(oldIds[i]);
+            aLines.push_back(prefix + i);
+        }
+        else
+        {
+            oldChanged[prefix + i] = 1;
+        }
+    }
+    for (size_t j = 0; j < newIds.size(); j++)
+    {
+        if (sides[newIds[j]] == 3)
+        {
+            b.push_back(newIds[j]);
+            bLines.push_back(prefix + j);
+        }
+        else
+        {
+            newChanged[prefix + j] = 1;
+        }
+    }
+
+    vector<char> aChanged(a.size(), 0), bChanged(b.size(), 0);
+    MyersDiff(a, b, aChanged, bChanged).compare(0, a.size(), 0, b.size());
+    for (size_t i = 0; i < a.size(); i++)
+        oldChanged[aLines[i]] = aChanged[i];
+    for (size_t j = 0; j < b.size(); j++)
+        newChanged[bLines[j]] = bChanged[j];
+
+    // Unchanged lines pair up in order; every gap between them is an edit
+    vector<DiffEdit> edits;
+    size_t i = 0, j = 0;
+    while (i < n || j < m)
+    {
+        if (i < n && j < m && !oldChanged[i] && !newChanged[j])
+        {
+            i++;
+            j++;
+            continue;
+        }
+        DiffEdit edit = {i, 0, j, 0};
+        while (i < n && oldChanged[i])
+            i++;
+        while (j < m && newChanged[j])
+            j++;
+        edit.oldCount = i - edit.oldStart;
+        edit.newCount = j - edit.newStart;
+        if (edit.oldCount == 0 && edit.newCount == 0)
+            break;
+        edits.push_back(edit);
+    }
+    return edits;
+}
+
+// Reads a blob (empty for the null id) chunk by chunk. A NUL byte in the
+// first BINARY_PROBE bytes marks it binary and stops the read there.
+bool readDiffBlob(const ObjectId &id, string &content, bool &binary)
+{
+    content.clear();
+    binary = false;
+    if (id.isNull())
+        return true;
+
+    ObjectReader reader;
+    if (!reader.open(id) || reader.type != "blob")
+        return false;
+    content.reserve(reader.size);
+    char buffer[BUFFER_SIZE];
+    ssize_t bytesRead;
+    while ((bytesRead = reader.read(buffer, BUFFER_SIZE)) > 0)
+    {
+        size_t probed = content.size();
+        content.append(buffer, bytesRead);
+        if (probed < BINARY_PROBE &&
+            memchr(content.data() + probed, 0, min<size_t>(content.size(), BINARY_PROBE) - probed))
+        {
+            binary = true;
+            return true;
+        }
+    }
+    return bytesRead == 0;
+}
+
+// Line-level comparison of two blobs; the lines point into the contents
+struct BlobDiff
+{
+    string oldContent;
+    string newContent;
+    bool binary = false;
+    vector<string_view> oldLines;
+    vector<string_view> newLines;
+    vector<DiffEdit> edits;
+
+    bool compute(const ObjectId &oldId, const ObjectId &newId)
+    {
+        bool oldBinary, newBinary;
+        if (!readDiffBlob(oldId, oldContent, oldBinary))
+        {
+            cerr << "ERR: Cannot read blob " << oldId << '\n';
+            return false;
+        }
+        if (!readDiffBlob(newId, newContent, newBinary))
+        {
+            cerr << "ERR: Cannot read blob " << newId << '\n';
+            return false;
+        }
+        binary = oldBinary || newBinary;
+        if (binary)
+            return true;
+        splitLines(oldContent, oldLines);
+        splitLines(newContent, newLines);
+        edits = diffLines(oldLines, newLines);
+        return true;
+    }
+
+    size_t insertions() const
+    {
+        size_t count = 0;
+        for (const DiffEdit &edit : edits)
+            count += edit.newCount;
+        return count;
+    }
+
+    size_t deletions() const
+    {
+        size_t count = 0;
+        for (const DiffEdit &edit : edits)
+            count += edit.oldCount;
+        return count;
+    }
+};
+
+void printDiffLine(char marker, string_view line)
+{
+    cout << marker << line;
+    if (line.empty() || line.back() != '\n')
+        cout << "\n\\ No newline at end of file\n";
+}
+
+string hunkRange(size_t start, size_t count)
+{
+    if (count == 1)
+        return to_string(start + 1);
+    return to_string(count == 0 ? start : start + 1) + "," + to_string(count);
+}
+
+// Prints the edits as unified diff hunks with DIFF_CONTEXT lines of context;
+// edits whose context would overlap share a hunk
+void printHunks(const BlobDiff &diff)
+{
+    const vector<DiffEdit> &edits = diff.edits;
+    for (size_t first = 0; first < edits.size();)
+    {
+        size_t last = first;
+        while (last + 1 < edits.size() &&
+               edits[last + 1].oldStart - (edits[last].oldStart + edits[last].oldCount) <= 2 * DIFF_CONTEXT)
+            last++;
+
+        size_t before = min<size_t>(DIFF_CONTEXT, edits[first].oldStart);
+        size_t oldEnd = edits[last].oldStart + edits[last].oldCount;
+        size_t after = min<size_t>(DIFF_CONTEXT, diff.oldLines.size() - oldEnd);
+        size_t oldFrom = edits[first].oldStart - before;
+        size_t newFrom = edits[first].newStart - before;
+        size_t oldCount = oldEnd + after - oldFrom;
+        size_t newCount = edits[last].newStart + edits[last].newCount + after - newFrom;
+        cout << "@@ -" << hunkRange(oldFrom, oldCount) << " +" << hunkRange(newFrom, newCount) << " @@\n";
+
+        size_t line = oldFrom;
+        for (size_t e = first; e <= last; e++)
+        {
+            for (; line < edits[e].oldStart; line++)
+                printDiffLine(' ', diff.oldLines[line]);
+            for (size_t k = 0; k < edits[e].oldCount; k++)
+                printDiffLine('-', diff.oldLines[edits[e].oldStart + k]);
+            for (size_t k = 0; k < edits[e].newCount; k++)
+                printDiffLine('+', diff.newLines[edits[e].newStart + k]);
+            line = edits[e].oldStart + edits[e].oldCount;
+        }
+        for (; line < oldEnd + after; line++)
+            printDiffLine(' ', diff.oldLines[line]);
+        first = last + 1;
+    }
+}
+
+// Prints a git-style patch for one changed file
+bool printFileDiff(const TreeChange &change)
+{
+    const string &oldPath = change.oldPath.empty() ? change.path : change.oldPath;
+    cout << "diff --git a/" << oldPath << " b/" << change.path << '\n';
+    if (change.status == 'A')
+        cout << "new file mode " << treeModeString(change.newMode) << '\n';
+    else if (change.status == 'D')
+        cout << "deleted file mode " << treeModeString(change.oldMode) << '\n';
+    else if (change.oldMode != change.newMode)
+        cout << "old mode " << treeModeString(change.oldMode) << "\nnew mode " << treeModeString(change.newMode) << '\n';
+    if (change.status == 'R' || change.status == 'C')
+    {
+        const char *kind = change.status == 'R' ? "rename" : "copy";
+        cout << "similarity index " << change.similarity << "%\n"
+             << kind << " from " << oldPath << '\n'
+             << kind << " to " << change.path << '\n';
+        if (change.oldId == change.newId)
+            return true;
+    }
+    cout << "index " << change.oldId.toHex().substr(0, 7) << ".." << change.newId.toHex().substr(0, 7);
+    if (change.status != 'A' && change.status != 'D' && change.oldMode == change.newMode)
+        cout << ' ' << treeModeString(change.newMode);
+    cout << '\n';
+
+    BlobDiff diff;
+    if (!diff.compute(change.oldId, change.newId))
+        return false;
+    string oldName = change.status == 'A' ? "/dev/null" : "a/" + oldPath;
+    string newName = change.status == 'D' ? "/dev/null" : "b/" + change.path;
+    if (diff.binary)
+    {
+        cout << "Binary files " << oldName << " and " << newName << " differ\n";
+        return true;
+    }
+    if (diff.edits.empty())
+        return true;
+    cout << "--- " << oldName << "\n+++ " << newName << '\n';
+    printHunks(diff);
+    return true;
+}
+
+// Writes a commit-graph covering every commit reachable from the refs
+int writeCommitGraph()
+{
+    unordered_map<ObjectId, CommitInfo, ObjectIdHash> commits;
+    vector<ObjectId> pending = refTips();
+    while (!pending.empty())
+    {
+        ObjectId sha = pending.back();
+        pending.pop_back();
+        if (commits.count(sha))
+            continue;
+
+        CommitInfo info;
+        if (!parseCommit(getObjData(sha), info))
+        {
+            cerr << "ERR: Not a commit object " << sha << '\n';
+            return 1;
+        }
+        if (info.parents.size() > 2)
+        {
+            cerr << "ERR: Commit " << sha << " has more than two parents\n";
+            return 1;
+        }
+        for (const ObjectId &parent : info.parents)
+            pending.push_back(parent);
+        commits[sha] = info;
+    }
+
+    vector<ObjectId> ids;
+    for (auto &[sha, info] : commits)
+        ids.push_back(sha);
+    sort(ids.begin(), ids.end());
+    unordered_map<ObjectId, uint32_t, ObjectIdHash> positions;
+    for (uint32_t i = 0; i < ids.size(); i++)
+        positions[ids[i]] = i;
+
+    // Generation numbers, computed parents first without recursion
+    for (const ObjectId &start : ids)
+    {
+        vector<ObjectId> stack = {start};
+        while (!stack.empty())
+        {
+            CommitInfo &info = commits[stack.back()];
+            if (info.generation)
+            {
+                stack.pop_back();
+                continue;
+            }
+            uint32_t generation = 1;
+            bool ready = true;
+            for (const ObjectId &parent : info.parents)
+            {
+                uint32_t parentGeneration = commits[parent].generation;
+                if (!parentGeneration)
+                {
+                    stack.push_back(parent);
+                    ready = false;
+                }
+                generation = max(generation, parentGeneration + 1);
+            }
+            if (ready)
+            {
+                info.generation = generation;
+                stack.pop_back();
+            }
+        }
+    }
+
+    string graphData = GRAPH_SIGNATURE;
+    putBigEndian(graphData, GRAPH_VERSION, 4);
+    putBigEndian(graphData, ids.size(), 4);
+    vector<uint32_t> fanout(256, 0);
+    for (const ObjectId &sha : ids)
+        fanout[sha.hash[0]]++;
+    uint32_t cumulative = 0;
+    for (uint32_t count : fanout)
+    {
+        cumulative += count;
+        putBigEndian(graphData, cumulative, 4);
+    }
+    for (const ObjectId &sha : ids)
+        graphData.append(reinterpret_cast<const char *>(sha.hash), SHA_DIGEST_LENGTH);
+    for (const ObjectId &sha : ids)
+    {
+        const CommitInfo &info = commits[sha];
+        graphData.append(reinterpret_cast<const char *>(info.tree.hash), SHA_DIGEST_LENGTH);
+        for (size_t i = 0; i < 2; i++)
+            putBigEndian(graphData, i < info.parents.size() ? positions[info.parents[i]] : GRAPH_PARENT_NONE, 4);
+        putBigEndian(graphData, info.generation, 4);
+        putBigEndian(graphData, static_cast<uint64_t>(info.timestamp), 8);
+    }
+
+    // Changed paths are taken against the first parent, or the empty tree
+    string blooms;
+    for (const ObjectId &sha : ids)
+    {
+        const CommitInfo &info = commits[sha];
+        ObjectId parentTree = info.parents.empty() ? ObjectId() : commits[info.parents[0]].tree;
+        vector<string> changed;
+        changedTreePaths(parentTree, info.tree, "", changed);
+        blooms += buildBloomFilter(changed);
+        putBigEndian(graphData, blooms.size(), 4);
+    }
+    graphData += blooms;
+
+    unsigned char hash[SHA_DIGEST_LENGTH];
+    SHA1(reinterpret_cast<const unsigned char *>(graphData.data()), graphData.size(), hash);
+    graphData.append(reinterpret_cast<const char *>(hash), SHA_DIGEST_LENGTH);
+
+    error_code ec;
+    create_directories(".mygit/objects/info", ec);
+    string tempPath = ".mygit/objects/info/commit-graph.tmp";
+    ofstream graphFile(tempPath, ios::binary | ios::trunc);
+    graphFile.write(graphData.data(), graphData.size());
+    graphFile.close();
+    if (!graphFile || rename(tempPath.c_str(), ".mygit/objects/info/commit-graph") != 0)
+    {
+        cerr << "ERR: Failed to write commit-graph\n";
+        unlink(tempPath.c_str());
+        return 1;
+    }
+    cout << "Wrote commit-graph with " << ids.size() << " commits\n";
+    return 0;
+}
+
+// Visits start and its ancestors newest first, until visit returns false
+void walkHistory(const ObjectId &start, const function<bool(const ObjectId &, const CommitInfo &)> &visit)
+{
+    auto older = [](const pair<CommitInfo, ObjectId> &a, const pair<CommitInfo, ObjectId> &b)
+    {
+        if (a.first.timestamp != b.first.timestamp)
+            return a.first.timestamp < b.first.timestamp;
+        return a.first.generation < b.first.generation;
+    };
+    priority_queue<pair<CommitInfo, ObjectId>, vector<pair<CommitInfo, ObjectId>>, decltype(older)> queue(older);
+    unordered_set<ObjectId, ObjectIdHash> seen = {start};
+
+    CommitInfo info;
+    if (!lookupCommit(start, info))
+        return;
+    queue.emplace(info, start);
+    while (!queue.empty())
+    {
+        auto [commit, sha] = queue.top();
+        queue.pop();
+        if (!visit(sha, commit))
+            return;
+        for (const ObjectId &parent : commit.parents)
+        {
+            if (!seen.insert(parent).second)
+                continue;
+            if (lookupCommit(parent, info))
+                queue.emplace(info, parent);
+        }
+    }
+}
+
+string extractlog(string &commitData, const ObjectId &commitsha)
+{
+
+    istringstream ss(commitData);
+    string header;
+    getline(ss, header, '\0');
+    string type;
+    stringstream strstr(header);
+    strstr >> type;
+    if (type != "commit")
+    {
+        cout << "Not a commit object\n";
+        return "";
+    }
+
+    string userName, userEmail, treeSHA, parentsha;
+    string timestamp, message;
+    getline(ss, userName, '\0');
+    getline(ss, userEmail, '\0');
+    getline(ss, treeSHA, '\0');
+    getline(ss, parentsha, '\0');
+    getline(ss, timestamp, '\0');
+    getline(ss, message, '\0');
+    cout << "commit " << commitsha << '\n';
+    cout << "Author: " << userName << " " << "<" << userEmail << ">\n";
+    cout << "Date:   " << timestamp << '\n';
+    cout << "parentsha: " << parentsha << '\n';
+
+    cout << "\t" << message << "\n\n";
+    return parentsha;
+}
+
+// Whether the commit changed filepath relative to its first parent. The
+// commit's Bloom filter answers most of these without reading any tree.
+bool commitTouchesPath(const ObjectId &sha, const CommitInfo &commit, const string &filepath, const vector<uint32_t> &key)
+{
+    uint32_t pos;
+    const char *filter;
+    size_t length;
+    if (commitGraph().find(sha, pos) && commitGraph().bloomFilter(pos, filter, length) &&
+        !bloomMaybeContains(filter, length, key))
+        return false;
+
+    ObjectId parentId;
+    CommitInfo parent;
+    if (!commit.parents.empty() && lookupCommit(commit.parents[0], parent))
+        parentId = treeEntryId(parent.tree, filepath);
+    return treeEntryId(commit.tree, filepath) != parentId;
+}
+
+// Lists the files a commit changed relative to its first parent with the
+// number of lines each one gained and lost
+void displayStat(const CommitInfo &commit)
+{
+    ObjectId parentTree;
+    CommitInfo parent;
+    if (!commit.parents.empty() && lookupCommit(commit.parents[0], parent))
+        parentTree = parent.tree;
+
+    struct FileStat
+    {
+        string path;
+        bool binary;
+        size_t insertions;
+        size_t deletions;
+    };
+    vector<TreeChange> changes;
+    diffTrees(parentTree, commit.tree, "", [&](const TreeChange &change)
+              { changes.push_back(change); });
+    detectRenames(changes);
+
+    vector<FileStat> files;
+    for (const TreeChange &change : changes)
+    {
+        string path = change.oldPath.empty() ? change.path : change.oldPath + " => " + change.path;
+        if (change.oldId == change.newId)
+        {
+            files.push_back({path, false, 0, 0});
+            continue;
+        }
+        BlobDiff diff;
+        if (diff.compute(change.oldId, change.newId))
+            files.push_back({path, diff.binary, diff.insertions(), diff.deletions()});
+    }
+
+    size_t nameWidth = 0, mostChanged = 0, insertions = 0, deletions = 0;
+    for (const FileStat &file : files)
+    {
+        nameWidth = max(nameWidth, file.path.size());
+        mostChanged = max(mostChanged, file.insertions + file.deletions);
+        insertions += file.insertions;
+        deletions += file.deletions;
+    }
+    size_t countWidth = to_string(mostChanged).size();
+    const size_t graphWidth = 50;
+    for (const FileStat &file : files)
+    {
+        cout << ' ' << file.path << string(nameWidth - file.path.size(), ' ') << " | ";
+        if (file.binary)
+        {
+            cout << "Bin\n";
+            continue;
+        }
+        size_t plus = file.insertions, minus = file.deletions;
+        if (mostChanged > graphWidth)
+        {
+            plus = (plus * graphWidth + mostChanged - 1) / mostChanged;
+            minus = (minus * graphWidth + mostChanged - 1) / mostChanged;
+        }
+        string count = to_string(file.insertions + file.deletions);
+        cout << string(countWidth - count.size(), ' ') << count;
+        if (plus + minus > 0)
+            cout << ' ' << string(plus, '+') << string(minus, '-');
+        cout << '\n';
+    }
+    cout << ' ' << files.size() << (files.size() == 1 ? " file changed" : " files changed");
+    if (insertions)
+        cout << ", " << insertions << (insertions == 1 ? " insertion(+)" : " insertions(+)");
+    if (deletions)
+        cout << ", " << deletions << (deletions == 1 ? " deletion(-)" : " deletions(-)");
+    cout << "\n\n";
+}
+
+void displaycommit(const ObjectId &commitsha, string filepath = "", bool stat = false)
+{
+    vector<uint32_t> key = bloomKey(filepath);
+    walkHistory(commitsha, [&](const ObjectId &sha, const CommitInfo &commit)
+                {
+        if (!filepath.empty() && !commitTouchesPath(sha, commit, filepath, key))
+            return true;
+        string commitData = getObjData(sha);
+        // cout << "Data: " << commitData;
+        extractlog(commitData, sha);
+        if (stat)
+            displayStat(commit);
+        return true; });
+}
+
+// Commit the current branch (or a detached HEAD) points to, null before the first commit
+ObjectId readHead()
+{
+    ifstream headFile(".mygit/HEAD");
+    string head;
+    getline(headFile, head);
+    if (head.compare(0, 5, "ref: ") != 0)
+        return ObjectId::parse(head);
+
+    ifstream branchFile(".mygit/" + head.substr(5));
+    string sha;
+    getline(branchFile, sha);
+    return ObjectId::parse(sha);
+}
+// Flattens a tree into path -> blob id and records the tree of every
+// directory as a cache-tree node. count receives the number of files below it.
+bool collectCheckoutFiles(const ObjectId &treeSha, const string &prefix, map<string, ObjectId> &files,
+                          map<string, CacheTreeNode> &trees, uint32_t &count)
+{
+    string treeData = getObjData(treeSha);
+    TreeView tree(treeData);
+    if (!tree.isValid())
+        return false;
+
+    count = 0;
+    for (const TreeItem &item : tree)
+    {
+        string name = prefix + string(item.name);
+        if (item.isTree())
+        {
+            uint32_t subtreeCount;
+            if (!collectCheckoutFiles(item.id, name + "/", files, trees, subtreeCount))
+                return false;
+            count += subtreeCount;
+        }
+        else
+        {
+            files[name] = item.id;
+            count++;
+        }
+    }
+    trees[prefix.empty() ? "" : prefix.substr(0, prefix.size() - 1)] = {treeSha, count};
+    return true;
+}
+
+// Whether the work tree file at name holds something other than id (null for
+// "no file"). A missing file never counts as a change.
+bool workTreeDiffers(Index &index, const string &name, const ObjectId &id)
+{
+    struct stat st;
+    if (lstat(name.c_str(), &st) != 0)
+        return false;
+    if (id.isNull() || !S_ISREG(st.st_mode))
+        return true;
+    Metadata *entry = index.find(name);
+    if (entry && !entry->removed && entry->sha == id && index.isStatClean(*entry, st))
+        return false;
+    return hashObject(name, false) != id;
+}
+
+// Replaces the file at filepath with the content of a blob, streaming it from
+// the object store, and returns the stat data of the new file in st
+bool writeBlobToFile(const ObjectId &id, const string &filepath, struct stat &st)
+{
+    ObjectReader reader;
+    if (!reader.open(id) || reader.type != "blob")
+    {
+        cerr << "ERR: Cannot read blob " << id << " for " << filepath << '\n';
+        return false;
+    }
+
+    unlink(filepath.c_str());
+    int fd = open(filepath.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0)
+    {
+        cerr << "ERR: Cannot create file " << filepath << '\n';
+        return false;
+    }
+    char buffer[BUFFER_SIZE];
+    ssize_t bytesRead;
+    bool written = true;
+    while (written && (bytesRead = reader.read(buffer, BUFFER_SIZE)) > 0)
+        written = ::write(fd, buffer, bytesRead) == bytesRead;
+    written = written && bytesRead == 0 && fstat(fd, &st) == 0;
+    close(fd);
+    if (!written)
+        cerr << "ERR: Failed to write file " << filepath << '\n';
+    return written;
+}
+
+// Tree named by a branch, HEAD or a commit or tree id; null if there is none
+ObjectId resolveTree(const string &name)
+{
+    ObjectId sha;
+    if (name == "HEAD")
+    {
+        sha = readHead();
+    }
+    else if (exists(".mygit/refs/heads/" + name))
+    {
+        ifstream branchFile(".mygit/refs/heads/" + name);
+        string line;
+        getline(branchFile, line);
+        sha = ObjectId::parse(line);
+    }
+    else
+    {
+        sha = ObjectId::parse(name);
+    }
+    if (sha.isNull())
+        return sha;
+
+    string object = getObjData(sha);
+    if (object.compare(0, 5, "tree ") == 0)
+        return sha;
+    CommitInfo info;
+    if (!parseCommit(object, info))
+        return ObjectId();
+    return info.tree;
+}
+
+// Prints the files that differ between two trees in git's raw diff format,
+// pairing renames and copies if asked to
+int diffTree(const string &from, const string &to, bool renames)
+{
+    ObjectId oldTree = resolveTree(from);
+    ObjectId newTree = resolveTree(to);
+    if (oldTree.isNull() || newTree.isNull())
+    {
+        cerr << "ERR: Unknown tree " << (oldTree.isNull() ? from : to) << '\n';
+        return 1;
+    }
+
+    vector<TreeChange> changes;
+    if (!diffTrees(oldTree, newTree, "", [&](const TreeChange &change)
+                   { changes.push_back(change); }))
+        return 1;
+    if (renames)
+        detectRenames(changes);
+
+    auto mode = [](TreeMode mode)
+    { return mode == MODE_UNKNOWN ? "000000" : treeModeString(mode); };
+    for (const TreeChange &change : changes)
+    {
+        cout << ':' << mode(change.oldMode) << ' ' << mode(change.newMode) << ' ' << change.oldId << ' '
+             << change.newId << ' ' << change.status;
+        if (change.status == 'R' || change.status == 'C')
+            cout << setfill('0') << setw(3) << change.similarity << setfill(' ') << '\t' << change.oldPath;
+        cout << '\t' << change.path << '\n';
+    }
+    return 0;
+}
+
+// Whether name is the id of a blob
+bool isBlob(const string &name)
+{
+    ObjectId id;
+    ObjectReader reader;
+    return ObjectId::fromHex(name, id) && reader.open(id) && reader.type == "blob";
+}
+
+// Prints a patch between two blobs, or between every changed file of two
+// trees, commits or branches
+int diff(const string &from, const string &to)
+{
+    if (isBlob(from) && isBlob(to))
+    {
+        BlobDiff diff;
+        if (!diff.compute(ObjectId::parse(from), ObjectId::parse(to)))
+            return 1;
+        if (diff.binary)
+        {
+            cout << "Binary files a/" << from << " and b/" << to << " differ\n";
+        }
+        else if (!diff.edits.empty())
+        {
+            cout << "--- a/" << from << "\n+++ b/" << to << '\n';
+            printHunks(diff);
+        }
+        return 0;
+    }
+
+    ObjectId oldTree = resolveTree(from);
+    ObjectId newTree = resolveTree(to);
+    if (oldTree.isNull() || newTree.isNull())
+    {
+        cerr << "ERR: Unknown blob or tree " << (oldTree.isNull() ? from : to) << '\n';
+        return 1;
+    }
+    vector<TreeChange> changes;
+    if (!diffTrees(oldTree, newTree, "", [&](const TreeChange &change)
+                   { changes.push_back(change); }))
+        return 1;
+    detectRenames(changes);
+
+    int status = 0;
+    for (const TreeChange &change : changes)
+    {
+        if (!printFileDiff(change))
+            status = 1;
+    }
+    return status;
+}
+
+// Switches the work tree, the index and HEAD (to headLine) to the commit
+// targetSha. Staged and local changes to files that differ between HEAD and
+// the target stop the checkout before anything is touched; other changes are
+// carried over. Files whose staged id already matches the target are left
+// alone unless they are missing from the work tree, the remaining blobs are
+// written in parallel and the index is saved once at the end.
+int checkoutCommit(const ObjectId &targetSha, const string &headLine, const string &target)
+{
+    CommitInfo targetCommit;
+    map<string, ObjectId> targetFiles;
+    map<string, CacheTreeNode> targetTrees;
+    uint32_t count;
+    if (!parseCommit(getObjData(targetSha), targetCommit) ||
+        !collectCheckoutFiles(targetCommit.tree, "", targetFiles, targetTrees, count))
+    {
+        cerr << "ERR: Cannot read commit " << target << '\n';
+        return 1;
+    }
+
+    map<string, ObjectId> headFiles;
+    map<string, CacheTreeNode> headTrees;
+    CommitInfo headCommit;
+    ObjectId headSha = readHead();
+    if (!headSha.isNull() && (!parseCommit(getObjData(headSha), headCommit) ||
+                              !collectCheckoutFiles(headCommit.tree, "", headFiles, headTrees, count)))
+    {
+        cerr << "ERR: Cannot read the current commit\n";
+        return 1;
+    }
+
+    Index index;
+    if (!index.lock() || !index.load())
+        return 1;
+    auto headId = [&headFiles](const string &name)
+    {
+        auto it = headFiles.find(name);
+        return it == headFiles.end() ? ObjectId() : it->second;
+    };
+
+    vector<string> conflicts, removals, carried;
+    vector<pair<string, ObjectId>> writes;
+    for (auto &[name, id] : targetFiles)
+    {
+        Metadata *entry = index.find(name);
+        ObjectId staged = (entry && !entry->removed) ? entry->sha : ObjectId();
+        if (staged == id)
+        {
+            // The index already holds the target's version. A file deleted
+            // from the work tree is written back; local edits are carried.
+            struct stat st;
+            if (lstat(name.c_str(), &st) != 0)
+                writes.emplace_back(name, id);
+            continue;
+        }
+        // Overwriting is safe when nothing but HEAD's version would be lost,
+        // or when the file already holds the target's content
+        bool clean = staged == headId(name) && !workTreeDiffers(index, name, staged);
+        if (clean || !workTreeDiffers(index, name, id))
+            writes.emplace_back(name, id);
+        else
+            conflicts.push_back(name);
+    }
+    for (const Metadata &entry : index.entries)
+    {
+        string name(entry.path);
+        if (entry.removed || targetFiles.count(name))
+            continue;
+        ObjectId original = headId(name);
+        if (original.isNull())
+            carried.push_back(name);
+        else if (entry.sha != original || workTreeDiffers(index, name, entry.sha))
+            conflicts.push_back(name);
+        else
+            removals.push_back(name);
+    }
+    if (!conflicts.empty())
+    {
+        for (const string &name : conflicts)
+            cerr << "ERR: Local changes to " << name << " would be overwritten by checkout\n";
+        return 1;
+    }
+
+    error_code ec;
+    for (const string &name : removals)
+    {
+        unlink(name.c_str());
+        index.upsert(name).removed = true;
+        for (path dir = path(name).parent_path(); !dir.empty(); dir = dir.parent_path())
+        {
+            if (!remove(dir, ec))
+                break;
+        }
+    }
+    unordered_set<string> directories;
+    for (auto &[name, id] : writes)
+    {
+        string dir = path(name).parent_path().string();
+        if (!dir.empty() && directories.insert(dir).second)
+            create_directories(dir, ec);
+    }
+
+    ThreadPool &pool = workPool();
+    vector<struct stat> stats(writes.size());
+    vector<future<bool>> pending;
+    for (size_t i = 0; i < writes.size(); i++)
+    {
+        pending.push_back(pool.submit([&writes, &stats, i]
+                                      { return writeBlobToFile(writes[i].second, writes[i].first, stats[i]); }));
+    }
+    bool failed = false;
+    for (size_t i = 0; i < writes.size(); i++)
+    {
+        if (!pool.wait(pending[i]))
+        {
+            failed = true;
+            continue;
+        }
+        Metadata &entry = index.upsert(writes[i].first);
+        entry.sha = writes[i].second;
+        entry.mode = 0100644;
+        fillStat(entry, stats[i]);
+    }
+
+    // The index now matches the target's trees, apart from carried-over changes
+    index.cacheTree = targetTrees;
+    index.hasCacheTree = true;
+    for (const string &name : carried)
+        index.invalidate(name);
+    for (auto &[name, id] : targetFiles)
+    {
+        Metadata *entry = index.find(name);
+        if (!entry || entry->removed || entry->sha != id)
+            index.invalidate(name);
+    }
+    if (!index.save() || failed)
+        return 1;
+
+    ofstream headFile(".mygit/HEAD", ios::trunc);
+    headFile << headLine << '\n';
+    headFile.close();
+    cout << "Checked out " << target << " (" << writes.size() << " files written, "
+         << removals.size() << " removed)\n";
+    return 0;
+}
+
+// Checks out target, which names a branch or a commit (the latter detaches
+// HEAD)
+int checkout(const string &target)
+{
+    string headLine;
+    ObjectId targetSha;
+    if (exists(".mygit/refs/heads/" + target))
+    {
+        ifstream branchFile(".mygit/refs/heads/" + target);
+        string sha;
+        getline(branchFile, sha);
+        targetSha = ObjectId::parse(sha);
+        headLine = "ref: refs/heads/" + target;
+    }
+    else if (ObjectId::fromHex(target, targetSha))
+    {
+        headLine = targetSha.toHex();
+    }
+    if (targetSha.isNull())
+    {
+        cerr << "ERR: Unknown branch or commit " << target << '\n';
+        return 1;
+    }
+    return checkoutCommit(targetSha, headLine, target);
+}
+
+// Creates a branch at HEAD, or with no name lists the branches and marks
+// the current one
+int branch(const string &name)
+{
+    if (name.empty())
+    {
+        ifstream headFile(".mygit/HEAD");
+        string head;
+        getline(headFile, head);
+        vector<string> names;
+        error_code ec;
+        for (auto &ref : directory_iterator(".mygit/refs/heads", ec))
+            names.push_back(ref.path().filename().string());
+        sort(names.begin(), names.end());
+        for (const string &branchName : names)
+            cout << (head == "ref: refs/heads/" + branchName ? "* " : "  ") << branchName << '\n';
+        return 0;
+    }
+
+    ObjectId head = readHead();
+    if (head.isNull())
+    {
+        cerr << "ERR: No commits till now\n";
+        return 1;
+    }
+    if (name.find('/') != string::npos || name[0] == '.' || exists(".mygit/refs/heads/" + name))
+    {
+        cerr << "ERR: Cannot create branch " << name << '\n';
+        return 1;
+    }
+    ofstream refFile(".mygit/refs/heads/" + name, ios::trunc);
+    refFile << head;
+    return 0;
+}
+
+// Best common ancestor of two commits (null if they share no history). Both
+// histories are walked together, highest generation first: commits missing
+// from the commit-graph are newer than it and come before those in it, date
+// breaks ties. Without generations a skewed clock can reach a common commit
+// before one of its descendants that is also common, so commits reached from
+// both sides mark their ancestors stale and the walk goes on until only
+// stale commits are queued. Of the common commits that are not stale, the
+// first one reached is returned.
+ObjectId mergeBase(const ObjectId &one, const ObjectId &two)
+{
+    if (one == two)
+        return one;
+
+    const int fromOne = 1, fromTwo = 2, stale = 4, result = 8;
+    typedef tuple<CommitInfo, ObjectId, bool> QueuedCommit;
+    auto lower = [](const QueuedCommit &a, const QueuedCommit &b)
+    {
+        const CommitInfo &aInfo = get<0>(a), &bInfo = get<0>(b);
+        uint32_t aGeneration = aInfo.generation ? aInfo.generation : UINT32_MAX;
+        uint32_t bGeneration = bInfo.generation ? bInfo.generation : UINT32_MAX;
+        if (aGeneration != bGeneration)
+            return aGeneration < bGeneration;
+        return aInfo.timestamp < bInfo.timestamp;
+    };
+    priority_queue<QueuedCommit, vector<QueuedCommit>, decltype(lower)> queue(lower);
+    unordered_map<ObjectId, int, ObjectIdHash> flags;
+    // entries queued without the stale flag
+    size_t active = 0;
+    auto enqueue = [&](const ObjectId &sha, int flag)
+    {
+        int &current = flags[sha];
+        if ((current | flag) == current)
+            return;
+        current |= flag;
+        CommitInfo info;
+        if (!lookupCommit(sha, info))
+            return;
+        bool isStale = current & stale;
+        if (!isStale)
+            active++;
+        queue.emplace(info, sha, isStale);
+    };
+    enqueue(one, fromOne);
+    enqueue(two, fromTwo);
+
+    vector<ObjectId> results;
+    while (active > 0)
+    {
+        auto [commit, sha, queuedStale] = queue.top();
+        queue.pop();
+        if (!queuedStale)
+            active--;
+        int &current = flags[sha];
+        int flag = current & (fromOne | fromTwo | stale);
+        if (flag == (fromOne | fromTwo))
+        {
+            if (!(current & result))
+            {
+                current |= result;
+                results.push_back(sha);
+            }
+            flag |= stale;
+        }
+        for (const ObjectId &parent : commit.parents)
+            enqueue(parent, flag);
+    }
+
+    for (const ObjectId &sha : results)
+        if (!(flags[sha] & stale))
+            return sha;
+    return ObjectId();
+}
+
+// Three-way line merge of blobs (null for a missing one). Edits that the two
+// sides made to overlapping or adjacent base lines conflict unless they are
+// identical; conflicting regions are written between markers.
+bool mergeBlobs(const ObjectId &base, const ObjectId &ours, const ObjectId &theirs, const string &label,
+                ObjectId &merged, bool &conflict)
+{
+    BlobDiff oursDiff, theirsDiff;
+    if (!oursDiff.compute(base, ours) || !theirsDiff.compute(base, theirs))
+        return false;
+    conflict = false;
+    if (oursDiff.binary || theirsDiff.binary)
+    {
+        merged = ours;
+        conflict = true;
+        return true;
+    }
+
+    const vector<string_view> &baseLines = oursDiff.oldLines;
+    const vector<string_view> &oursLines = oursDiff.newLines;
+    const vector<string_view> &theirsLines = theirsDiff.newLines;
+    const vector<DiffEdit> &a = oursDiff.edits;
+    const vector<DiffEdit> &b = theirsDiff.edits;
+    string result;
+    auto emit = [&result](const vector<string_view> &lines, size_t from, size_t to)
+    {
+        for (size_t k = from; k < to; k++)
+            result.append(lines[k]);
+    };
+    // Markers start on a line of their own
+    auto marker = [&result](const string &line)
+    {
+        if (!result.empty() && result.back() != '\n')
+            result.push_back('\n');
+        result += line + "\n";
+    };
+
+    size_t i = 0, j = 0, basePos = 0;
+    int64_t oursShift = 0, theirsShift = 0;
+    while (i < a.size() || j < b.size())
+    {
+        size_t start = min(i < a.size() ? a[i].oldStart : SIZE_MAX, j < b.size() ? b[j].oldStart : SIZE_MAX);
+        size_t end = start, iEnd = i, jEnd = j;
+        int64_t oursGrowth = 0, theirsGrowth = 0;
+        // Pull in every edit of either side that overlaps or touches the chunk
+        for (bool grew = true; grew;)
+        {
+            grew = false;
+            if (iEnd < a.size() && a[iEnd].oldStart <= end)
+            {
+                end = max(end, a[iEnd].oldStart + a[iEnd].oldCount);
+                oursGrowth += int64_t(a[iEnd].newCount) - int64_t(a[iEnd].oldCount);
+                iEnd++;
+                grew = true;
+            }
+            if (jEnd < b.size() && b[jEnd].oldStart <= end)
+            {
+                end = max(end, b[jEnd].oldStart + b[jEnd].oldCount);
+                theirsGrowth += int64_t(b[jEnd].newCount) - int64_t(b[jEnd].oldCount);
+                jEnd++;
+                grew = true;
+            }
+        }
+
+        emit(baseLines, basePos, start);
+        size_t oursFrom = start + oursShift, oursTo = end + oursShift + oursGrowth;
+        size_t theirsFrom = start + theirsShift, theirsTo = end + theirsShift + theirsGrowth;
+        if (jEnd == j)
+        {
+            emit(oursLines, oursFrom, oursTo);
+        }
+        else if (iEnd == i)
+        {
+            emit(theirsLines, theirsFrom, theirsTo);
+        }
+        else if (equal(oursLines.begin() + oursFrom, oursLines.begin() + oursTo,
+                       theirsLines.begin() + theirsFrom, theirsLines.begin() + theirsTo))
+        {
+            emit(oursLines, oursFrom, oursTo);
+        }
+        else
+        {
+            conflict = true;
+            marker("<<<<<<< HEAD");
+            emit(oursLines, oursFrom, oursTo);
+            marker("=======");
+            emit(theirsLines, theirsFrom, theirsTo);
+            marker(">>>>>>> " + label);
+        }
+        oursShift += oursGrowth;
+        theirsShift += theirsGrowth;
+        basePos = end;
+        i = iEnd;
+        j = jEnd;
+    }
+    emit(baseLines, basePos, baseLines.size());
+
+    merged = storeObject("blob", result.data(), result.size(), true);
+    return !merged.isNull();
+}
+
+// Three-way merge of trees (null for a missing one) into merged. A subtree
+// whose id matches on two sides is taken as it is without being read, so
+// directories that only one side touched cost nothing. Conflicting paths are
+// added to conflicts; the merged tree keeps their content with markers, or
+// the side that still has the path.
+bool mergeTrees(const ObjectId &base, const ObjectId &ours, const ObjectId &theirs, const string &prefix,
+                const string &label, ObjectId &merged, vector<string> &conflicts)
+{
+    if (ours == theirs || base == theirs)
+    {
+        merged = ours;
+        return true;
+    }
+    if (base == ours)
+    {
+        merged = theirs;
+        return true;
+    }
+
+    const ObjectId *ids[3] = {&base, &ours, &theirs};
+    string data[3];
+    vector<TreeItem> items[3];
+    for (int side = 0; side < 3; side++)
+    {
+        if (!readTreeItems(*ids[side], data[side], items[side]))
+        {
+            cerr << "ERR: Cannot read tree " << *ids[side] << '\n';
+            return false;
+        }
+    }
+    map<string_view, array<const TreeItem *, 3>> names;
+    for (int side = 0; side < 3; side++)
+    {
+        for (const TreeItem &item : items[side])
+        {
+            auto &sides = names.emplace(item.name, array<const TreeItem *, 3>{}).first->second;
+            sides[side] = &item;
+        }
+    }
+
+    auto same = [](const TreeItem *x, const TreeItem *y)
+    { return x == y || (x && y && x->id == y->id && x->mode == y->mode); };
+    vector<TreeEntry> entries;
+    for (auto &[name, sides] : names)
+    {
+        const TreeItem *b = sides[0], *o = sides[1], *t = sides[2];
+        string filepath = prefix + string(name);
+        const TreeItem *taken;
+        if (same(o, t) || same(b, t))
+        {
+            taken = o;
+        }
+        else if (same(b, o))
+        {
+            taken = t;
+        }
+        else if (o && t && o->isTree() && t->isTree())
+        {
+            ObjectId subtree;
+            if (!mergeTrees(b && b->isTree() ? b->id : ObjectId(), o->id, t->id, filepath + "/", label, subtree, conflicts))
+                return false;
+            if (!subtree.isNull())
+                entries.push_back({treeModeString(MODE_TREE), string(name), "tree", subtree});
+            continue;
+        }
+        else if (o && t && !o->isTree() && !t->isTree())
+        {
+            ObjectId blob;
+            bool conflict;
+            if (!mergeBlobs(b && !b->isTree() ? b->id : ObjectId(), o->id, t->id, label, blob, conflict))
+                return false;
+            if (conflict)
+                conflicts.push_back(filepath);
+            TreeMode mode = b && b->mode == o->mode ? t->mode : o->mode;
+            entries.push_back({treeModeString(mode), string(name), "blob", blob});
+            continue;
+        }
+        else
+        {
+            // Deleted on one side and changed on the other, or a file on one
+            // side and a directory on the other
+            conflicts.push_back(filepath);
+            taken = o ? o : t;
+        }
+        if (taken)
+            entries.push_back(toTreeEntry(*taken));
+    }
+
+    // A directory left without entries disappears from its parent
+    if (entries.empty() && !prefix.empty())
+    {
+        merged = ObjectId();
+        return true;
+    }
+    merged = writeTreeEntries(entries);
+    return !merged.isNull();
+}
+
+bool diffTreeToIndex(const ObjectId &tree, const Index &index, vector<const Metadata *>::iterator begin,
+                     vector<const Metadata *>::iterator end, const string &dir,
+                     const function<void(const TreeChange &)> &visit);
+
+// Merges branch (or a commit) into HEAD. An ancestor of HEAD needs nothing
+// and a descendant is fast-forwarded to. Otherwise the trees are merged
+// three-way against the merge base, the work tree and index take the result,
+// and a commit with both parents is recorded. On conflicts the files keep
+// markers, MERGE_HEAD is left for the commit that resolves them and the
+// conflicted paths stay unstaged and are listed in MERGE_CONFLICTS until they
+// are added.
+int merge(const string &branch)
+{
+    ObjectId theirsSha;
+    if (exists(".mygit/refs/heads/" + branch))
+    {
+        ifstream branchFile(".mygit/refs/heads/" + branch);
+        string sha;
+        getline(branchFile, sha);
+        theirsSha = ObjectId::parse(sha);
+    }
+    else
+    {
+        theirsSha = ObjectId::parse(branch);
+    }
+    ObjectId oursSha = readHead();
+    if (theirsSha.isNull() || oursSha.isNull())
+    {
+        cerr << "ERR: " << (oursSha.isNull() ? "No commits till now" : "Unknown branch or commit " + branch) << '\n';
+        return 1;
+    }
+    if (exists(MERGE_HEAD))
+    {
+        cerr << "ERR: A merge is in progress; commit it first\n";
+        return 1;
+    }
+
+    ObjectId base = mergeBase(oursSha, theirsSha);
+    if (base == theirsSha)
+    {
+        cout << "Already up to date\n";
+        return 0;
+    }
+    ifstream headFile(".mygit/HEAD");
+    string headLine;
+    getline(headFile, headLine);
+    headFile.close();
+    if (base == oursSha)
+    {
+        string detached = theirsSha.toHex();
+        bool onBranch = headLine.compare(0, 5, "ref: ") == 0;
+        if (checkoutCommit(theirsSha, onBranch ? headLine : detached, branch) != 0)
+            return 1;
+        if (onBranch)
+        {
+            ofstream refFile(".mygit/" + headLine.substr(5), ios::trunc);
+            refFile << theirsSha;
+        }
+        cout << "Fast-forward to " << theirsSha << '\n';
+        return 0;
+    }
+
+    CommitInfo oursCommit, theirsCommit, baseCommit;
+    if (!lookupCommit(oursSha, oursCommit) || !lookupCommit(theirsSha, theirsCommit) ||
+        (!base.isNull() && !lookupCommit(base, baseCommit)))
+    {
+        cerr << "ERR: Cannot read the commits to merge\n";
+        return 1;
+    }
+    Index index;
+    if (!index.lock() || !index.load())
+        return 1;
+    // The index is compared with our tree without writing any tree for it
+    vector<const Metadata *> staged;
+    for (const Metadata &entry : index.entries)
+    {
+        if (!entry.removed)
+            staged.push_back(&entry);
+    }
+    sort(staged.begin(), staged.end(), [](const Metadata *a, const Metadata *b)
+         { return a->path < b->path; });
+    bool dirty = false;
+    if (!diffTreeToIndex(oursCommit.tree, index, staged.begin(), staged.end(), "", [&dirty](const TreeChange &)
+                         { dirty = true; }))
+        return 1;
+    if (dirty)
+    {
+        cerr << "ERR: Commit or unstage your changes before merging\n";
+        return 1;
+    }
+
+    ObjectId mergedTree;
+    vector<string> conflicts;
+    if (!mergeTrees(baseCommit.tree, oursCommit.tree, theirsCommit.tree, "", branch, mergedTree, conflicts))
+        return 1;
+    vector<TreeChange> changes;
+    if (!diffTrees(oursCommit.tree, mergedTree, "", [&](const TreeChange &change)
+                   { changes.push_back(change); }))
+        return 1;
+
+    // Local changes to the files the merge rewrites stop it before anything
+    // is touched
+    bool blocked = false;
+    for (const TreeChange &change : changes)
+    {
+        if (workTreeDiffers(index, change.path, change.oldId))
+        {
+            cerr << "ERR: Local changes to " << change.path << " would be overwritten by merge\n";
+            blocked = true;
+        }
+    }
+    if (blocked)
+        return 1;
+
+    unordered_set<string> conflicted(conflicts.begin(), conflicts.end());
+    vector<TreeChange> writes;
+    error_code ec;
+    for (const TreeChange &change : changes)
+    {
+        index.invalidate(change.path);
+        if (change.status != 'D')
+        {
+            writes.push_back(change);
+            continue;
+        }
+        unlink(change.path.c_str());
+        index.upsert(change.path).removed = true;
+        for (path dir = path(change.path).parent_path(); !dir.empty(); dir = dir.parent_path())
+        {
+            if (!remove(dir, ec))
+                break;
+        }
+    }
+    for (const TreeChange &change : writes)
+        create_directories(path(change.path).parent_path(), ec);
+
+    ThreadPool &pool = workPool();
+    vector<struct stat> stats(writes.size());
+    vector<future<bool>> pending;
+    for (size_t i = 0; i < writes.size(); i++)
+    {
+        pending.push_back(pool.submit([&writes, &stats, i]
+                                      { return writeBlobToFile(writes[i].newId, writes[i].path, stats[i]); }));
+    }
+    bool failed = false;
+    for (size_t i = 0; i < writes.size(); i++)
+    {
+        if (!pool.wait(pending[i]))
+        {
+            failed = true;
+            continue;
+        }
+        if (conflicted.count(writes[i].path))
+            continue;
+        Metadata &entry = index.upsert(writes[i].path);
+        entry.sha = writes[i].newId;
+        entry.mode = 0100644;
+        fillStat(entry, stats[i]);
+    }
+    if (!index.save() || failed)
+        return 1;
+
+    // The conflicts are recorded before MERGE_HEAD, so a commit never sees
+    // the merge without them
+    sort(conflicts.begin(), conflicts.end());
+    if (!writeMergeConflicts(conflicts))
+        return 1;
+    ofstream mergeFile(MERGE_HEAD, ios::trunc);
+    mergeFile << theirsSha << '\n';
+    mergeFile.close();
+    if (!conflicts.empty())
+    {
+        for (const string &name : conflicts)
+            cout << "CONFLICT: Merge conflict in " << name << '\n';
+        cout << "Automatic merge failed; fix conflicts, add them and commit the result\n";
+        return 1;
+    }
+
+    string message = "Merge branch '" + branch + "'";
+    ObjectId sha = commit(message);
+    if (sha.isNull())
+        return 1;
+    cout << "Merge made by the three-way strategy: " << sha << '\n';
+    return 0;
+}
+
+// A file found by the status walk. Untracked directories are reported as a
+// whole, as "dir/".
+struct WorkTreeFile
+{
+    string path;
+    bool untracked = false;
+    bool modified = false;
+    // the content still matches the index even though the stat data does not
+    bool refresh = false;
+    struct stat st = {};
+};
+
+void statxToStat(const struct statx &sx, struct stat &st)
+{
+    memset(&st, 0, sizeof(st));
+    st.st_mode = sx.stx_mode;
+    st.st_dev = makedev(sx.stx_dev_major, sx.stx_dev_minor);
+    st.st_ino = sx.stx_ino;
+    st.st_size = sx.stx_size;
+    st.st_mtim.tv_sec = sx.stx_mtime.tv_sec;
+    st.st_mtim.tv_nsec = sx.stx_mtime.tv_nsec;
+    st.st_ctim.tv_sec = sx.stx_ctime.tv_sec;
+    st.st_ctim.tv_nsec = sx.stx_ctime.tv_nsec;
+}
+
+// Whether dir ("a/b/") holds a file at any depth. Each directory is statted
+// before it is read, so that a later change to it shows in its stamp.
+UntrackedContents searchForFiles(const string &dir)
+{
+    UntrackedContents contents;
+    vector<string> pending = {dir};
+    while (!pending.empty())
+    {
+        string current = move(pending.back());
+        pending.pop_back();
+        struct stat st;
+        DIR *handle = lstat(current.c_str(), &st) == 0 && S_ISDIR(st.st_mode) ? opendir(current.c_str()) : nullptr;
+        if (!handle)
+            continue;
+        DirStamp stamp{current, st.st_mtim.tv_sec, st.st_mtim.tv_nsec};
+        while (const struct dirent *entry = readdir(handle))
+        {
+            if (strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0)
+                continue;
+            string filepath = current + entry->d_name;
+            struct stat child;
+            if (lstat(filepath.c_str(), &child) != 0)
+                continue;
+            if (S_ISDIR(child.st_mode))
+                pending.push_back(filepath + "/");
+            else if (S_ISREG(child.st_mode) || (S_ISLNK(child.st_mode) && stat(filepath.c_str(), &child) == 0 && S_ISREG(child.st_mode)))
+                contents.hasFiles = true;
+            if (contents.hasFiles)
+                break;
+        }
+        closedir(handle);
+        if (contents.hasFiles)
+        {
+            contents.stamps = {stamp};
+            return contents;
+        }
+        contents.stamps.push_back(move(stamp));
+    }
+    return contents;
+}
+
+// The cached answer for an untracked directory, as long as every stamp still
+// matches its directory and none was taken as racily as the index itself
+const UntrackedContents *cachedContents(const Index &index, const string &dir)
+{
+    auto it = index.untrackedContents.find(dir);
+    if (it == index.untrackedContents.end())
+        return nullptr;
+    for (const DirStamp &stamp : it->second.stamps)
+    {
+        struct stat st;
+        if (lstat(stamp.path.c_str(), &st) != 0 || !S_ISDIR(st.st_mode) ||
+            st.st_mtim.tv_sec != stamp.mtimeSec || st.st_mtim.tv_nsec != stamp.mtimeNsec ||
+            index.isRacyTime(stamp.mtimeSec, stamp.mtimeNsec))
+            return nullptr;
+    }
+    return &it->second;
+}
+
+// What the status walk found: the files, and the directories it had to list,
+// to be remembered in the untracked cache
+struct WorkTreeScan
+{
+    vector<WorkTreeFile> files;
+    vector<pair<string, UntrackedDir>> listed;
+    // every untracked directory looked at, and how many had to be searched
+    vector<pair<string, UntrackedContents>> contents;
+    size_t searched = 0;
+};
+
+// Scans dir ("" for the root, otherwise "a/b/") and compares its files with
+// the index. A directory whose mtime still matches its untracked cache entry
+// is not listed: its untracked names come from the cache and its staged files
+// from the index. Other directories are listed with getdents64. Staged files
+// are statted with statx unless the fsmonitor saw no change to them, and only
+// read when their stat data no longer matches. Subdirectories are scanned as
+// separate pool tasks.
+WorkTreeScan scanWorkTree(const Index &index, const string &dir, const FsmonitorChanges *changes)
+{
+    WorkTreeScan scan;
+    int fd = open(dir.empty() ? "." : dir.c_str(), O_RDONLY | O_DIRECTORY);
+    if (fd < 0)
+        return scan;
+
+    ThreadPool &pool = workPool();
+    vector<future<WorkTreeScan>> subdirs;
+    auto scanSubdir = [&](const string &subdir)
+    {
+        subdirs.push_back(pool.submit([&index, subdir, changes]
+                                      { return scanWorkTree(index, subdir, changes); }));
+    };
+    // An untracked directory is shown only if it holds a file somewhere
+    auto addUntracked = [&](const string &name)
+    {
+        string filepath = dir + name;
+        if (name.back() == '/')
+        {
+            const UntrackedContents *cachedDir = cachedContents(index, filepath);
+            scan.contents.emplace_back(filepath, cachedDir ? *cachedDir : searchForFiles(filepath));
+            scan.searched += !cachedDir;
+            if (!scan.contents.back().second.hasFiles)
+                return;
+        }
+        WorkTreeFile file;
+        file.path = filepath;
+        file.untracked = true;
+        scan.files.push_back(move(file));
+    };
+    // A staged file missing from the results counts as deleted
+    auto checkStaged = [&](const char *name, const Metadata &staged)
+    {
+        WorkTreeFile file;
+        file.path = dir + name;
+        if (!changes || changes->contains(file.path))
+        {
+            struct statx sx;
+            if (statx(fd, name, AT_SYMLINK_NOFOLLOW, STATX_BASIC_STATS, &sx) != 0 || !S_ISREG(sx.stx_mode))
+                return;
+            statxToStat(sx, file.st);
+            if (!index.isStatClean(staged, file.st))
+            {
+                file.modified = hashObject(file.path, false) != staged.sha;
+                file.refresh = !file.modified;
+            }
+        }
+        scan.files.push_back(move(file));
+    };
+
+    struct statx dirStat;
+    bool dirStatted = statx(fd, "", AT_EMPTY_PATH, STATX_MTIME, &dirStat) == 0;
+    const UntrackedDir *cached = dirStatted ? index.cachedUntracked(dir, dirStat.stx_mtime.tv_sec, dirStat.stx_mtime.tv_nsec) : nullptr;
+    if (cached)
+    {
+        for (const string &name : cached->names)
+            addUntracked(name);
+        index.listChildren(dir, [&](string_view name, bool isDir)
+                           {
+            string child(name);
+            if (isDir)
+                scanSubdir(dir + child + "/");
+            else
+                checkStaged(child.c_str(), *index.find(dir + child)); });
+    }
+    else
+    {
+        UntrackedDir listing;
+        listing.mtimeSec = dirStat.stx_mtime.tv_sec;
+        listing.mtimeNsec = dirStat.stx_mtime.tv_nsec;
+        char buffer[BUFFER_SIZE];
+        ssize_t length;
+        while ((length = getdents64(fd, buffer, sizeof(buffer))) > 0)
+        {
+            for (ssize_t offset = 0; offset < length;)
+            {
+                const struct dirent64 *entry = reinterpret_cast<const struct dirent64 *>(buffer + offset);
+                offset += entry->d_reclen;
+                const char *name = entry->d_name;
+                if (strcmp(name, ".") == 0 || strcmp(name, "..") == 0)
+                    continue;
+
+                unsigned char type = entry->d_type;
+                if (type == DT_UNKNOWN)
+                {
+                    struct statx sx;
+                    if (statx(fd, name, AT_SYMLINK_NOFOLLOW, STATX_TYPE, &sx) != 0)
+                        continue;
+                    type = S_ISDIR(sx.stx_mode) ? DT_DIR : S_ISREG(sx.stx_mode) ? DT_REG
+                                                                                : DT_UNKNOWN;
+                }
+                string filepath = dir + name;
+                if (type == DT_DIR)
+                {
+                    if (dir.empty() && (strcmp(name, ".mygit") == 0 || strcmp(name, ".git") == 0))
+                        continue;
+                    if (index.hasEntriesUnder(filepath + "/"))
+                        scanSubdir(filepath + "/");
+                    else
+                    {
+                        listing.names.push_back(string(name) + "/");
+                        addUntracked(listing.names.back());
+                    }
+                    continue;
+                }
+                if (type != DT_REG)
+                    continue;
+
+                const Metadata *staged = index.find(filepath);
+                if (staged && !staged->removed)
+                    checkStaged(name, *staged);
+                else
+                {
+                    listing.names.push_back(name);
+                    addUntracked(listing.names.back());
+                }
+            }
+        }
+        if (dirStatted)
+            scan.listed.emplace_back(dir, move(listing));
+    }
+    close(fd);
+
+    for (auto &subdir : subdirs)
+    {
+        WorkTreeScan found = pool.wait(subdir);
+        move(found.files.begin(), found.files.end(), back_inserter(scan.files));
+        move(found.listed.begin(), found.listed.end(), back_inserter(scan.listed));
+        move(found.contents.begin(), found.contents.end(), back_inserter(scan.contents));
+        scan.searched += found.searched;
+    }
+    return scan;
+}
+
+// Compares a stored tree (null for none) with the staged entries in
+// [begin, end), sorted by path and all under dir ("" or "a/b/"), and calls
+// visit for every file that differs, in path order. Sorted paths are already
+// in tree order. A directory whose cache-tree node is valid and equal to the
+// tree is skipped; other directories are compared entry by entry, so no tree
+// has to be written for the index.
+bool diffTreeToIndex(const ObjectId &tree, const Index &index, vector<const Metadata *>::iterator begin,
+                     vector<const Metadata *>::iterator end, const string &dir,
+                     const function<void(const TreeChange &)> &visit)
+{
+    auto cached = index.cacheTree.find(dir.empty() ? "" : dir.substr(0, dir.size() - 1));
+    if (!tree.isNull() && cached != index.cacheTree.end() &&
+        cached->second.entryCount == static_cast<uint32_t>(end - begin) && cached->second.id == tree)
+        return true;
+
+    string data;
+    vector<TreeItem> items;
+    if (!readTreeItems(tree, data, items))
+    {
+        cerr << "ERR: Cannot read tree " << tree << '\n';
+        return false;
+    }
+
+    bool ok = true;
+    auto report = [&](char status, const TreeItem *item, const Metadata *entry)
+    {
+        TreeChange change;
+        change.status = status;
+        change.path = entry ? string(entry->path) : dir + string(item->name);
+        if (item)
+        {
+            change.oldMode = item->mode;
+            change.oldId = item->id;
+        }
+        if (entry)
+        {
+            change.newMode = MODE_FILE;
+            change.newId = entry->sha;
+        }
+        visit(change);
+    };
+
+    size_t i = 0;
+    auto it = begin;
+    while (i < items.size() || it != end)
+    {
+        // The next staged child of dir: a file, or a subdirectory and its range
+        string_view name;
+        bool isDir = false;
+        auto childEnd = it;
+        if (it != end)
+        {
+            name = (*it)->path.substr(dir.size());
+            size_t slash = name.find('/');
+            isDir = slash != string_view::npos;
+            name = name.substr(0, isDir ? slash : name.size());
+            string subdir = dir + string(name) + "/";
+            ++childEnd;
+            while (isDir && childEnd != end && (*childEnd)->path.compare(0, subdir.size(), subdir) == 0)
+                ++childEnd;
+        }
+
+        int cmp = i == items.size() ? 1
+                  : it == end       ? -1
+                                    : compareTreeNames(items[i].name, items[i].isTree(), name, isDir);
+        const TreeItem *item = cmp <= 0 ? &items[i++] : nullptr;
+        if (cmp < 0)
+        {
+            if (item->isTree())
+                ok = diffTrees(item->id, ObjectId(), dir + string(item->name) + "/", visit) && ok;
+            else
+                report('D', item, nullptr);
+            continue;
+        }
+
+        if (isDir)
+            ok = diffTreeToIndex(item ? item->id : ObjectId(), index, it, childEnd, dir + string(name) + "/", visit) && ok;
+        else if (!item)
+            report('A', nullptr, *it);
+        else if (item->id != (*it)->sha || item->mode != MODE_FILE)
+            report('M', item, *it);
+        it = childEnd;
+    }
+    return ok;
+}
+
+// Shows what differs between the HEAD commit and the index (staged) and
+// between the index and the work tree (unstaged and untracked)
+int status()
+{
+    // Loaded without the lock, so status works while another command holds
+    // it and in a read-only checkout
+    Index index;
+    if (!index.load())
+        return 1;
+
+    ifstream headFile(".mygit/HEAD");
+    string head;
+    getline(headFile, head);
+    if (head.compare(0, 16, "ref: refs/heads/") == 0)
+        cout << "On branch " << head.substr(16) << "\n\n";
+    else
+        cout << "HEAD detached at " << head << "\n\n";
+
+    ObjectId headSha = readHead();
+    CommitInfo headCommit;
+    if (!headSha.isNull() && !parseCommit(getObjData(headSha), headCommit))
+    {
+        cerr << "ERR: Cannot read the current commit\n";
+        return 1;
+    }
+
+    vector<const Metadata *> staged;
+    for (const Metadata &entry : index.entries)
+    {
+        if (!entry.removed)
+            staged.push_back(&entry);
+    }
+    sort(staged.begin(), staged.end(), [](const Metadata *a, const Metadata *b)
+         { return a->path < b->path; });
+
+    // Directories whose cache-tree node matches HEAD are skipped; nothing is
+    // written, so status leaves the object store alone
+    vector<pair<string, string>> toCommit;
+    if (!diffTreeToIndex(headCommit.tree, index, staged.begin(), staged.end(), "", [&](const TreeChange &change)
+                         {
+        const char *label = change.status == 'A' ? "new file:   " : change.status == 'D' ? "deleted:    " : "modified:   ";
+        toCommit.emplace_back(label, change.path); }))
+        return 1;
+
+    FsmonitorChanges changes;
+    bool monitored = queryFsmonitor(index, changes);
+    WorkTreeScan scan = scanWorkTree(index, "", monitored ? &changes : nullptr);
+    vector<WorkTreeFile> &files = scan.files;
+    sort(files.begin(), files.end(), [](const WorkTreeFile &a, const WorkTreeFile &b)
+         { return a.path < b.path; });
+    vector<pair<string, string>> notStaged;
+    vector<string> untracked;
+    unordered_set<string_view> present;
+    bool refreshed = false;
+    for (const WorkTreeFile &file : files)
+    {
+        if (file.untracked)
+        {
+            untracked.push_back(file.path);
+            continue;
+        }
+        present.insert(file.path);
+        if (file.modified)
+            notStaged.emplace_back("modified:   ", file.path);
+        if (file.refresh)
+        {
+            fillStat(index.upsert(file.path), file.st);
+            refreshed = true;
+        }
+    }
+    for (const Metadata *entry : staged)
+    {
+        if (!present.count(entry->path))
+            notStaged.emplace_back("deleted:    ", string(entry->path));
+    }
+    // Everything the daemon reported has been looked at; what is still
+    // unstaged has to be looked at again next time
+    if (monitored)
+    {
+        index.fsmonitorToken = changes.token;
+        index.fsmonitorDirty.clear();
+        for (auto &[label, name] : notStaged)
+            index.fsmonitorDirty.push_back(name);
+    }
+    sort(notStaged.begin(), notStaged.end(), [](const pair<string, string> &a, const pair<string, string> &b)
+         { return a.second < b.second; });
+
+    auto section = [](const string &title, const vector<pair<string, string>> &changes)
+    {
+        if (changes.empty())
+            return;
+        cout << title << ":\n";
+        for (auto &[label, name] : changes)
+            cout << '\t' << label << name << '\n';
+        cout << '\n';
+    };
+    section("Changes to be committed", toCommit);
+    section("Changes not staged for commit", notStaged);
+    if (!untracked.empty())
+    {
+        cout << "Untracked files:\n";
+        for (const string &name : untracked)
+            cout << '\t' << name << '\n';
+        cout << '\n';
+    }
+    if (toCommit.empty() && notStaged.empty() && untracked.empty())
+        cout << "nothing to commit, working tree clean\n";
+
+    // Files whose content turned out unchanged get fresh stat data, so the
+    // next status does not read them again
+    for (auto &[dir, listing] : scan.listed)
+        index.untrackedCache[dir] = move(listing);
+    // Only directories still untracked are kept
+    bool contentsChanged = scan.searched > 0 || scan.contents.size() != index.untrackedContents.size();
+    index.untrackedContents.clear();
+    for (auto &[dir, contents] : scan.contents)
+        index.untrackedContents[dir] = move(contents);
+    if ((refreshed || monitored || !scan.listed.empty() || contentsChanged) && index.tryLock())
+        index.save();
+    return 0;
+}
+
+#define FSMONITOR_EVENTS (IN_CREATE | IN_DELETE | IN_MODIFY | IN_CLOSE_WRITE | IN_ATTRIB | IN_MOVED_FROM | IN_MOVED_TO | IN_ONLYDIR)
+// Changed paths remembered between queries before the daemon forgets them
+// and answers older tokens with "/"
+#define FSMONITOR_MAX_CHANGES 100000
+
+// Keeps inotify watches on every work tree directory and tells clients which
+// paths changed since a token it handed out. A request is a token (empty for
+// none) and a newline; the reply is the new token, then either "/" (anything
+// may have changed) or the changed paths, each terminated by a NUL. Tokens
+// are "<instance>:<sequence>": a token from another daemon, or from before
+// the daemon forgot changes (the kernel dropped events or too many paths
+// changed), is answered with "/".
+class FsmonitorDaemon
+{
+public:
+    int run()
+    {
+        signal(SIGPIPE, SIG_IGN);
+        inotifyFd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+        if (inotifyFd < 0)
+        {
+            cerr << "ERR: inotify is not available\n";
+            return 1;
+        }
+        instance = to_string(getpid()) + "-" + to_string(chrono::steady_clock::now().time_since_epoch().count());
+        addWatches("");
+
+        int listenFd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+        sockaddr_un address = {};
+        address.sun_family = AF_UNIX;
+        strncpy(address.sun_path, FSMONITOR_SOCKET, sizeof(address.sun_path) - 1);
+        unlink(FSMONITOR_SOCKET);
+        if (listenFd < 0 || bind(listenFd, reinterpret_cast<sockaddr *>(&address), sizeof(address)) != 0 ||
+            listen(listenFd, 16) != 0)
+        {
+            cerr << "ERR: Cannot listen on " << FSMONITOR_SOCKET << '\n';
+            return 1;
+        }
+
+        pollfd fds[2] = {{inotifyFd, POLLIN, 0}, {listenFd, POLLIN, 0}};
+        bool running = true;
+        while (running)
         {
-            ipStream.read(buffer, BUFFER_SIZE);
-            streamsize bytesRead = ipStream.gcount();
-            if (bytesRead == 0)
+            if (poll(fds, 2, -1) < 0)
+            {
+                if (errno == EINTR)
+                    continue;
                 break;
-
-            deflateStream.avail_in = bytesRead;
-            deflateStream.next_in = reinterpret_cast<Bytef *>(buffer);
-
-            do
+            }
+            if (fds[0].revents & POLLIN)
+                readEvents();
+            if (fds[1].revents & POLLIN)
             {
-                deflateStream.avail_out = BUFFER_SIZE;
-                deflateStream.next_out = reinterpret_cast<Bytef *>(compressBuffer);
-                deflate(&deflateStream, Z_NO_FLUSH);
-                outFile.write(compressBuffer, BUFFER_SIZE - deflateStream.avail_out);
-            } while (deflateStream.avail_out == 0);
+                int client = accept4(listenFd, nullptr, nullptr, SOCK_CLOEXEC);
+                if (client < 0)
+                    continue;
+                running = answer(client);
+                close(client);
+            }
         }
 
-        // Finish the compression
-        deflateStream.avail_in = 0;
-        deflateStream.next_in = nullptr;
-        do
-        {
-            deflateStream.avail_out = BUFFER_SIZE;
-            deflateStream.next_out = reinterpret_cast<Bytef *>(compressBuffer);
-
-            deflate(&deflateStream, Z_FINISH);
-            outFile.write(compressBuffer, BUFFER_SIZE - deflateStream.avail_out);
-        } while (deflateStream.avail_out == 0);
-
-        deflateEnd(&deflateStream);
-        outFile.close();
-        if (printsha)
-            cout << "Compressed and stored object at " << blobpath << '\n';
+        close(listenFd);
+        unlink(FSMONITOR_SOCKET);
+        close(inotifyFd);
+        return 0;
     }
 
-    return sha;
-}
-
-int catFile(string &flag, string &fileSha)
-{
-    string dirname = fileSha.substr(0, 2);
-    string filename = fileSha.substr(2);
-    string objPath = ".mygit/objects/" + dirname + '/' + filename;
-
-    ifstream ipStream(objPath, ios::binary);
-    if (!ipStream)
+private:
+    int inotifyFd = -1;
+    string instance;
+    uint64_t sequence = 0;
+    // changes up to this sequence were forgotten; older tokens get "/"
+    uint64_t forgotten = 0;
+    // set when a directory could not be watched; every answer is then "/"
+    bool incomplete = false;
+    // watch descriptor to its directory ("" or "a/b/")
+    unordered_map<int, string> watches;
+    // path to the sequence number of its last change
+    unordered_map<string, uint64_t> changed;
+
+    void forgetHistory()
     {
-        cerr << "ERR: Cannot open file " << objPath << "\n";
-        return 1;
+        forgotten = ++sequence;
+        changed.clear();
     }
 
-    z_stream inflateStream;
-    inflateStream.zalloc = Z_NULL;
-    inflateStream.zfree = Z_NULL;
-    inflateStream.opaque = Z_NULL;
-
-    if (inflateInit(&inflateStream) != Z_OK)
+    void addWatches(const string &dir)
     {
-        cerr << "ERR: Could not initialize decompression stream\n";
-        return 1;
-    }
-
-    char buffer[BUFFER_SIZE];
-    char decompressBuffer[BUFFER_SIZE];
+        int wd = inotify_add_watch(inotifyFd, dir.empty() ? "." : dir.c_str(), FSMONITOR_EVENTS);
+        if (wd < 0)
+        {
+            incomplete = true;
+            return;
+        }
+        watches[wd] = dir;
 
-    ipStream.read(buffer, BUFFER_SIZE);
-    inflateStream.avail_in = ipStream.gcount();
-    inflateStream.next_in = reinterpret_cast<Bytef *>(buffer);
+        error_code ec;
+        for (auto &entry : directory_iterator(dir.empty() ? "." : dir, ec))
+        {
+            string name = entry.path().filename().string();
+            if (dir.empty() && (name == ".mygit" || name == ".git"))
+                continue;
+            if (entry.is_directory(ec) && !entry.is_symlink(ec))
+                addWatches(dir + name + "/");
+        }
+    }
 
-    string header;
-    do
+    void removeWatches(const string &dir)
     {
-        inflateStream.avail_out = BUFFER_SIZE;
-        inflateStream.next_out = reinterpret_cast<Bytef *>(decompressBuffer);
-
-        int ret = inflate(&inflateStream, Z_NO_FLUSH);
-        if (ret == Z_STREAM_ERROR || ret == Z_DATA_ERROR || ret == Z_MEM_ERROR)
+        for (auto it = watches.begin(); it != watches.end();)
         {
-            cerr << "ERR: Decompression error\n";
-            inflateEnd(&inflateStream);
-            return 1;
+            if (it->second.compare(0, dir.size(), dir) == 0)
+            {
+                inotify_rm_watch(inotifyFd, it->first);
+                it = watches.erase(it);
+            }
+            else
+                ++it;
         }
+    }
 
-        header.append(decompressBuffer, BUFFER_SIZE - inflateStream.avail_out);
-
-    } while (header.find('\0') == string::npos);
-
-    size_t nullPos = header.find('\0');
-    string typeAndSize = header.substr(0, nullPos);
-    istringstream iss(typeAndSize);
-    string type;
-    size_t size;
-    iss >> type >> size;
-    if (flag == "-t")
+    void readEvents()
     {
-        cout << type << '\n';
+        alignas(struct inotify_event) char buffer[BUFFER_SIZE];
+        ssize_t length;
+        while ((length = read(inotifyFd, buffer, sizeof(buffer))) > 0)
+        {
+            for (ssize_t offset = 0; offset < length;)
+            {
+                const struct inotify_event *event = reinterpret_cast<const struct inotify_event *>(buffer + offset);
+                offset += sizeof(struct inotify_event) + event->len;
+                handleEvent(*event);
+            }
+        }
     }
-    else if (flag == "-s")
+
+    void handleEvent(const struct inotify_event &event)
     {
-        cout << size << '\n';
+        if (event.mask & IN_Q_OVERFLOW)
+        {
+            forgetHistory();
+            return;
+        }
+        auto watch = watches.find(event.wd);
+        if (watch == watches.end())
+            return;
+        if (event.mask & IN_IGNORED)
+        {
+            watches.erase(watch);
+            return;
+        }
+        // Events about a watched directory itself are reported by its parent
+        if (event.len == 0)
+            return;
+
+        string name = event.name;
+        if (watch->second.empty() && (name == ".mygit" || name == ".git"))
+            return;
+        string filepath = watch->second + name;
+        changed[filepath] = ++sequence;
+        if (changed.size() > FSMONITOR_MAX_CHANGES)
+            forgetHistory();
+        if (!(event.mask & IN_ISDIR))
+            return;
+        if (event.mask & (IN_DELETE | IN_MOVED_FROM))
+            removeWatches(filepath + "/");
+        if (event.mask & (IN_CREATE | IN_MOVED_TO))
+            addWatches(filepath + "/");
     }
-    else if (flag == "-p")
+
+    // Returns false when the client asked the daemon to stop
+    bool answer(int client)
     {
-        cout.write(header.data() + nullPos + 1, header.size() - (nullPos + 1));
-        while (ipStream)
+        timeval timeout = {2, 0};
+        setsockopt(client, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+        string request;
+        char c;
+        while (read(client, &c, 1) == 1 && c != '\n')
+            request += c;
+        if (request == "quit")
+            return false;
+
+        // Anything that happened before the request must be in the reply
+        readEvents();
+        string reply = instance + ":" + to_string(sequence);
+        reply += '\0';
+        size_t colon = request.rfind(':');
+        uint64_t since = colon == string::npos ? 0 : strtoull(request.c_str() + colon + 1, nullptr, 10);
+        if (incomplete || colon == string::npos || request.compare(0, colon, instance) != 0 || since < forgotten)
         {
-            ipStream.read(buffer, BUFFER_SIZE);
-            streamsize bytesRead = ipStream.gcount();
-            if (bytesRead == 0)
-                break;
-
-            inflateStream.avail_in = bytesRead;
-            inflateStream.next_in = reinterpret_cast<Bytef *>(buffer);
-
-            do
+            reply += "/";
+            reply += '\0';
+        }
+        else
+        {
+            for (auto &[filepath, changeSequence] : changed)
             {
-                inflateStream.avail_out = BUFFER_SIZE;
-                inflateStream.next_out = reinterpret_cast<Bytef *>(decompressBuffer);
-
-                int ret = inflate(&inflateStream, Z_NO_FLUSH);
-                if (ret == Z_STREAM_ERROR || ret == Z_DATA_ERROR || ret == Z_MEM_ERROR)
+                if (changeSequence > since)
                 {
-                    cerr << "ERR: Decompression error\n";
-                    inflateEnd(&inflateStream);
-                    return 1;
+                    reply += filepath;
+                    reply += '\0';
                 }
-                cout.write(decompressBuffer, BUFFER_SIZE - inflateStream.avail_out);
-            } while (inflateStream.avail_out == 0);
+            }
         }
-        cout << '\n';
-    }
-    else
-    {
-        cerr << "ERR: Invalid flag\n";
-        inflateEnd(&inflateStream);
-        ipStream.close();
-        return 1;
-    }
 
-    inflateEnd(&inflateStream);
-    ipStream.close();
-    return 0;
-}
+        for (size_t sent = 0; sent < reply.size();)
+        {
+            ssize_t written = send(client, reply.data() + sent, reply.size() - sent, MSG_NOSIGNAL);
+            if (written <= 0)
+                break;
+            sent += written;
+        }
+        return true;
+    }
+};
 
-string hashBlob(string &text)
+// fsmonitor start|stop|run: start forks the daemon into the background, run
+// keeps it in the foreground
+int fsmonitor(const string &action)
 {
-    unsigned char hash[SHA_DIGEST_LENGTH];
-    SHA1(reinterpret_cast<const unsigned char *>(text.c_str()), text.size(), hash);
-
-    string hashStr;
-    for (int i = 0; i < SHA_DIGEST_LENGTH; i++)
+    if (action == "run")
     {
-        char buffer[3];
-        sprintf(buffer, "%02x", hash[i]);
-        hashStr += buffer;
+        FsmonitorDaemon daemon;
+        return daemon.run();
     }
-
-    return hashStr;
-}
-
-string writeBlob(path &filepath)
-{
-    SHA_CTX shaContext;
-    SHA1_Init(&shaContext);
-
-    ifstream ipStream(filepath, ios::binary);
-    if (!ipStream)
+    if (action == "stop")
     {
-        cerr << "ERR: Cannot open file " << filepath << "\n";
-        return "";
+        int fd = connectFsmonitor();
+        if (fd < 0)
+        {
+            cout << "fsmonitor is not running\n";
+            return 0;
+        }
+        send(fd, "quit\n", 5, MSG_NOSIGNAL);
+        close(fd);
+        cout << "fsmonitor stopped\n";
+        return 0;
     }
-
-    char buffer[BUFFER_SIZE];
-    while (true)
+    if (action != "start")
     {
-        ipStream.read(buffer, BUFFER_SIZE);
-        streamsize bytesRead = ipStream.gcount();
-        if (bytesRead == 0)
-            break;
-
-        SHA1_Update(&shaContext, buffer, bytesRead);
+        cerr << "ERR: Usage: fsmonitor start|stop|run\n";
+        return 1;
     }
 
-    unsigned char hash[SHA_DIGEST_LENGTH];
-    SHA1_Final(hash, &shaContext);
-    stringstream ss;
-    for (int i = 0; i < SHA_DIGEST_LENGTH; i++)
+    int probe = connectFsmonitor();
+    if (probe >= 0)
     {
-        ss << hex << setw(2) << setfill('0') << static_cast<int>(hash[i]);
+        close(probe);
+        cout << "fsmonitor is already running\n";
+        return 0;
     }
-    string sha = ss.str();
-    // cout << "sha1 " << sha << " " << filepath << '\n';
-    return sha;
-}
-
-int writeObject(string &object, string objtype)
-{
-    string hash = hashBlob(object);
-    // cout << "tree hash: " << hash << " dirpath: " << dirpath << '\n';
-    string objPath = ".mygit/objects/" + hash.substr(0, 2);
-    create_directories(objPath);
-
-    objPath += "/" + hash.substr(2);
-    ofstream opFile(objPath, ios::binary);
-    string header = objtype + " " + to_string(object.size()) + '\0';
-    string fullobj = header + object;
-
-    z_stream deflateStream;
-    deflateStream.zalloc = Z_NULL;
-    deflateStream.zfree = Z_NULL;
-    deflateStream.opaque = Z_NULL;
-
-    if (deflateInit(&deflateStream, Z_BEST_COMPRESSION) != Z_OK)
+    pid_t pid = fork();
+    if (pid < 0)
     {
-        cerr << "ERR: Could not initialize compression stream\n";
+        cerr << "ERR: Cannot start fsmonitor\n";
         return 1;
     }
-
-    deflateStream.avail_in = fullobj.size();
-    deflateStream.next_in = reinterpret_cast<Bytef *>(fullobj.data());
-    char compressBuffer[BUFFER_SIZE];
-
-    do
+    if (pid == 0)
     {
-        deflateStream.avail_out = BUFFER_SIZE;
-        deflateStream.next_out = reinterpret_cast<Bytef *>(compressBuffer);
-        deflate(&deflateStream, Z_NO_FLUSH);
-        opFile.write(compressBuffer, BUFFER_SIZE - deflateStream.avail_out);
-    } while (deflateStream.avail_out == 0);
+        setsid();
+        int devNull = open("/dev/null", O_RDWR);
+        dup2(devNull, STDIN_FILENO);
+        dup2(devNull, STDOUT_FILENO);
+        dup2(devNull, STDERR_FILENO);
+        close(devNull);
+        FsmonitorDaemon daemon;
+        _exit(daemon.run());
+    }
 
-    deflateStream.avail_in = 0;
-    deflateStream.next_in = nullptr;
-    do
+    // The daemon is usable once its socket accepts connections
+    for (int attempt = 0; attempt < 250; attempt++)
     {
-        deflateStream.avail_out = BUFFER_SIZE;
-        deflateStream.next_out = reinterpret_cast<Bytef *>(compressBuffer);
-
-        deflate(&deflateStream, Z_FINISH);
-        opFile.write(compressBuffer, BUFFER_SIZE - deflateStream.avail_out);
-    } while (deflateStream.avail_out == 0);
-
-    deflateEnd(&deflateStream);
-    opFile.close();
-
-    return 0;
+        int fd = connectFsmonitor();
+        if (fd >= 0)
+        {
+            close(fd);
+            cout << "fsmonitor started\n";
+            return 0;
+        }
+        usleep(20000);
+    }
+    cerr << "ERR: fsmonitor did not start\n";
+    return 1;
 }
 
-string writeTree(path directoryPath)
+// Loose object ids plus the ids of every object in the current packs
+vector<ObjectId> listObjects()
 {
-    vector<string> entries;
-
-    for (auto &entry : directory_iterator(directoryPath))
+    vector<ObjectId> ids;
+    ObjectId id;
+    error_code ec;
+    for (auto &dir : directory_iterator(".mygit/objects", ec))
     {
-        if (entry.is_regular_file())
-        {
-            path filepath = entry.path();
-            string blobHash = writeBlob(filepath);
-            string entryData = "100644 " + entry.path().filename().string() + '\0' + blobHash;
-            entries.push_back(entryData);
-
-            hashObject(filepath, true);
-        }
-        else if (entry.is_directory())
+        string prefix = dir.path().filename().string();
+        if (prefix.size() != 2 || !dir.is_directory())
+            continue;
+        for (auto &file : directory_iterator(dir.path(), ec))
         {
-            if (entry.path().filename() == ".mygit" || entry.path().filename() == ".git")
-                continue;
-
-            path dirpath = entry.path();
-            string treeHash = writeTree(dirpath);
-            string entryData = "040000 " + entry.path().filename().string() + '\0' + treeHash;
-            entries.push_back(entryData);
+            if (ObjectId::fromHex(prefix + file.path().filename().string(), id))
+                ids.push_back(id);
         }
     }
-
-    string treeData;
-    for (const auto &entry : entries)
+    for (const Pack &pack : loadedPacks())
     {
-        treeData += entry;
+        for (uint32_t i = 0; i < pack.count; i++)
+            ids.push_back(pack.idAt(i));
     }
 
-    writeObject(treeData, "tree");
-    return hashBlob(treeData);
+    sort(ids.begin(), ids.end());
+    ids.erase(unique(ids.begin(), ids.end()), ids.end());
+    return ids;
 }
 
-string decompressData(const string &compressedData)
+void nameTreeObjects(const ObjectId &treeSha, unordered_map<ObjectId, string, ObjectIdHash> &names)
 {
-    string decompressedData;
-    z_stream inflateStream;
-    inflateStream.zalloc = Z_NULL;
-    inflateStream.zfree = Z_NULL;
-    inflateStream.opaque = Z_NULL;
-    inflateStream.avail_in = compressedData.size();
-    inflateStream.next_in = reinterpret_cast<Bytef *>(const_cast<char *>(compressedData.data()));
-
-    if (inflateInit(&inflateStream) != Z_OK)
+    string treeData = getObjData(treeSha);
+    for (const TreeItem &item : TreeView(treeData))
     {
-        cerr << "ERR: Could not initialize decompression stream\n";
-        return "";
+        if (!names.emplace(item.id, string(item.name)).second)
+            continue;
+        if (item.isTree())
+            nameTreeObjects(item.id, names);
     }
+}
 
-    char outBuffer[BUFFER_SIZE];
-    int ret;
-
-    do
+// Maps every object reachable from a branch to the file name it was found
+// under, so that repack can try deltas between revisions of the same file
+unordered_map<ObjectId, string, ObjectIdHash> collectObjectNames()
+{
+    unordered_map<ObjectId, string, ObjectIdHash> names;
+    error_code ec;
+    for (auto &ref : recursive_directory_iterator(".mygit/refs", ec))
     {
-        inflateStream.avail_out = BUFFER_SIZE;
-        inflateStream.next_out = reinterpret_cast<Bytef *>(outBuffer);
-
-        ret = inflate(&inflateStream, Z_NO_FLUSH);
-        if (ret == Z_STREAM_ERROR || ret == Z_DATA_ERROR || ret == Z_MEM_ERROR)
+        if (!ref.is_regular_file())
+            continue;
+        ifstream refFile(ref.path());
+        string refSha;
+        getline(refFile, refSha);
+        vector<ObjectId> pending = {ObjectId::parse(refSha)};
+        while (!pending.empty())
         {
-            cerr << "ERR: Decompression error\n";
-            inflateEnd(&inflateStream);
-            return "";
+            ObjectId commitSha = pending.back();
+            pending.pop_back();
+            CommitInfo info;
+            if (commitSha.isNull() || !names.emplace(commitSha, "").second || !parseCommit(getObjData(commitSha), info))
+                continue;
+            if (!info.tree.isNull() && names.emplace(info.tree, "").second)
+                nameTreeObjects(info.tree, names);
+            pending.insert(pending.end(), info.parents.begin(), info.parents.end());
         }
-
-        decompressedData.append(outBuffer, BUFFER_SIZE - inflateStream.avail_out);
-
-    } while (inflateStream.avail_out == 0);
-
-    ret = inflate(&inflateStream, Z_FINISH);
-    if (ret != Z_STREAM_END)
-    {
-        cerr << "ERR: Unexpected end of decompression\n";
-        inflateEnd(&inflateStream);
-        return "";
     }
-
-    inflateEnd(&inflateStream);
-    return decompressedData;
+    return names;
 }
-string decompressFile(string tree_sha)
+
+// Sort key that groups files with the same name suffix together
+uint32_t packNameHash(const string &name)
 {
-    string dir = tree_sha.substr(0, 2);
-    string file = tree_sha.substr(2);
-    string objPath = ".mygit/objects/" + dir + '/' + file;
-    ifstream inFile(objPath, ios::binary);
-    if (!inFile)
+    uint32_t hash = 0;
+    for (unsigned char c : name)
     {
-        cerr << "Tree object not foundxxx" << tree_sha << "\n";
-        return "";
+        if (isspace(c))
+            continue;
+        hash = (hash >> 2) + (static_cast<uint32_t>(c) << 24);
     }
-
-    stringstream buffer;
-    buffer << inFile.rdbuf();
-    string compressedData = buffer.str();
-
-    string treeData = decompressData(compressedData);
-    return treeData;
+    return hash;
 }
 
-string extractTreeSHA(const string &commitObject)
+struct PackCandidate
 {
-    istringstream ss(commitObject);
-    string header, userName, userEmail, treeSHA;
+    ObjectId sha;
+    int type = OBJ_NONE;
+    uint64_t size = 0;
+    uint32_t nameHash = 0;
+    // set when the object is stored as a delta
+    ObjectId baseSha;
+    int depth = 0;
+};
 
-    getline(ss, header, '\0');
-    getline(ss, userName, '\0');
-    getline(ss, userEmail, '\0');
-    getline(ss, treeSHA, '\0');
-    return treeSHA;
-}
+// Number of preceding objects tried as delta bases for each object
+#define DELTA_WINDOW 10
 
-unordered_map<string, TreeEntry> parseTreeDataMap(string treeData)
+// Consolidates all loose and packed objects into a single new pack, then
+// removes the loose copies and the old packs. Objects are sorted by type, name
+// and size, and each one is stored as a delta against the best base among the
+// previous DELTA_WINDOW objects when that saves at least half its size. Objects
+// over BIG_OBJECT_SIZE are stored whole and never become bases.
+int repack()
 {
-    unordered_map<string, TreeEntry> newTreeMap;
-    ssize_t pos = 0;
-    size_t stringEnd = treeData.find('\0', pos);
-    stringstream ss;
-    ss << treeData.substr(0, stringEnd);
-    string objtype, objsize;
-    ss >> objtype >> objsize;
-    ss.clear();
-    if (objtype != "tree")
+    vector<ObjectId> ids = listObjects();
+    if (ids.empty())
     {
-        cout << "Not a tree objectxxx " << treeData << "\n";
-        return newTreeMap;
+        cout << "Nothing to pack\n";
+        return 0;
     }
 
-    pos = stringEnd + 1;
-    while (pos < treeData.size())
+    unordered_map<ObjectId, string, ObjectIdHash> names = collectObjectNames();
+    // Only the headers are read here; each object is inflated once, below
+    vector<PackCandidate> candidates;
+    ObjectReader reader;
+    for (const ObjectId &sha : ids)
     {
-        TreeEntry entry;
-        stringEnd = treeData.find('\0', pos);
-        ss << treeData.substr(pos, stringEnd - pos);
-        ss >> entry.filemod >> entry.filename;
-        ss.clear();
-        pos = stringEnd + 1;
-
-        entry.filehash.clear();
-        entry.filehash = treeData.substr(pos, 40);
-        pos += 40;
-        entry.filetype = (entry.filemod == "100644" ? "blob" : "tree");
-        newTreeMap[entry.filename] = entry;
-        cout << "entry: " << entry.filename << '\n'
-             << entry.filehash << '\n';
+        if (!reader.open(sha))
+        {
+            cerr << "ERR: Cannot read object " << sha << '\n';
+            return 1;
+        }
+        PackCandidate candidate;
+        candidate.sha = sha;
+        candidate.type = packTypeCode(reader.type);
+        candidate.size = reader.size;
+        candidate.nameHash = packNameHash(names[sha]);
+        candidates.push_back(candidate);
     }
-    return newTreeMap;
-}
-
-vector<TreeEntry> parseTreeData(string treeData)
-{
-    vector<TreeEntry> entries;
-    ssize_t pos = 0;
-    size_t stringEnd = treeData.find('\0', pos);
-    stringstream ss;
-    ss << treeData.substr(0, stringEnd);
-    string objtype, objsize;
-    ss >> objtype >> objsize;
-    ss.clear();
-    if (objtype != "tree")
+    sort(candidates.begin(), candidates.end(), [](const PackCandidate &a, const PackCandidate &b)
+         {
+        if (a.type != b.type)
+            return a.type < b.type;
+        if (a.nameHash != b.nameHash)
+            return a.nameHash < b.nameHash;
+        return a.size > b.size; });
+
+    error_code ec;
+    create_directories(".mygit/objects/pack", ec);
+    string tempPack = ".mygit/objects/pack/tmp_pack_XXXXXX";
+    int fd = mkstemp(tempPack.data());
+    if (fd < 0)
     {
-        cout << "Not a tree objectyyy " << treeData << "\n ";
-        return entries;
+        cerr << "ERR: Cannot create pack file\n";
+        return 1;
     }
 
-    pos = stringEnd + 1;
-    while (pos < treeData.size())
+    SHA_CTX shaContext;
+    SHA1_Init(&shaContext);
+    uint64_t written = 0;
+    bool failed = false;
+    auto emit = [&](const string &chunk)
+    {
+        SHA1_Update(&shaContext, chunk.data(), chunk.size());
+        if (::write(fd, chunk.data(), chunk.size()) != static_cast<ssize_t>(chunk.size()))
+            failed = true;
+        written += chunk.size();
+    };
+
+    string header = PACK_SIGNATURE;
+    putBigEndian(header, PACK_VERSION, 4);
+    putBigEndian(header, ids.size(), 4);
+    emit(header);
+
+    unordered_map<ObjectId, uint64_t, ObjectIdHash> offsets;
+    // (candidate position, content) of the objects tried as delta bases
+    deque<pair<size_t, string>> window;
+    // buffer of the object that last left the window, reused for the next read
+    string spare;
+    size_t deltaCount = 0;
+    for (size_t i = 0; i < candidates.size() && !failed; i++)
     {
-        TreeEntry entry;
-        stringEnd = treeData.find('\0', pos);
-        ss << treeData.substr(pos, stringEnd - pos);
-        ss >> entry.filemod >> entry.filename;
-        ss.clear();
-        pos = stringEnd + 1;
+        PackCandidate &candidate = candidates[i];
+        string content = move(spare);
+        if (!reader.open(candidate.sha) || !reader.readAll(content))
+        {
+            cerr << "ERR: Cannot read object " << candidate.sha << '\n';
+            failed = true;
+            break;
+        }
 
-        entry.filehash.clear();
-        entry.filehash = treeData.substr(pos, 40);
-        pos += 40;
-        entry.filetype = (entry.filemod == "100644" ? "blob" : "tree");
-        entries.push_back(entry);
-    }
-    return entries;
-}
+        bool big = candidate.size > BIG_OBJECT_SIZE;
+        string best;
+        for (auto &[basePos, baseContent] : window)
+        {
+            const PackCandidate &base = candidates[basePos];
+            if (big || base.type != candidate.type || base.depth >= MAX_DELTA_DEPTH)
+                continue;
+            size_t maxSize = best.empty() ? content.size() / 2 : best.size();
+            string delta = createDelta(baseContent, content, maxSize);
+            if (!delta.empty())
+            {
+                best = delta;
+                candidate.baseSha = base.sha;
+                candidate.depth = base.depth + 1;
+            }
+        }
 
-void displayTree(vector<TreeEntry> &entries, bool nameonly)
-{
-    if (nameonly)
-    {
-        for (TreeEntry entry : entries)
+        const string &stored = best.empty() ? content : best;
+        uint64_t size = stored.size();
+        string entry;
+        unsigned char byte = ((best.empty() ? candidate.type : OBJ_REF_DELTA) << 4) | (size & 15);
+        size >>= 4;
+        while (size)
         {
-            cout << entry.filename;
-            if (entry.filetype == "tree")
-                cout << "/";
-            cout << '\n';
+            entry.push_back(byte | 0x80);
+            byte = size & 0x7f;
+            size >>= 7;
         }
-    }
-    else
-    {
-        for (TreeEntry entry : entries)
+        entry.push_back(byte);
+        if (!best.empty())
         {
-            cout << entry.filemod << "  " << entry.filetype << "  " << entry.filehash << "  " << entry.filename << '\n';
+            entry.append(reinterpret_cast<const char *>(candidate.baseSha.hash), SHA_DIGEST_LENGTH);
+            deltaCount++;
         }
-    }
-}
 
-string getObjData(string tree_sha)
-{
-    string dir = tree_sha.substr(0, 2);
-    string file = tree_sha.substr(2);
-    string objPath = ".mygit/objects/" + dir + '/' + file;
-    ifstream inFile(objPath, ios::binary);
-    if (!inFile)
-    {
-        cerr << "Tree object not foundyyyy" << tree_sha << "\n";
-        return {};
-    }
+        vector<char> compressed(compressBound(stored.size()));
+        uLongf compressedSize = compressed.size();
+        compress2(reinterpret_cast<Bytef *>(compressed.data()), &compressedSize,
+                  reinterpret_cast<const Bytef *>(stored.data()), stored.size(), Z_BEST_COMPRESSION);
+        entry.append(compressed.data(), compressedSize);
 
-    stringstream buffer;
-    buffer << inFile.rdbuf();
-    string compressedData = buffer.str();
-    string treeData = decompressData(compressedData);
-    return treeData;
-}
+        offsets[candidate.sha] = written;
+        emit(entry);
 
-unordered_map<string, TreeEntry> getTreeData(string tree_sha)
-{
-    string treeData = getObjData(tree_sha);
-    if (treeData.empty())
-    {
-        cerr << "ERR: Failed to decompress tree object\n";
-        return {};
+        if (big)
+            continue;
+        window.emplace_back(i, move(content));
+        if (window.size() > DELTA_WINDOW)
+        {
+            spare = move(window.front().second);
+            window.pop_front();
+        }
     }
 
-    return parseTreeDataMap(treeData);
-}
-
-int lstree(string tree_sha, bool nameonly)
-{
-    string dir = tree_sha.substr(0, 2);
-    string file = tree_sha.substr(2);
-    string objPath = ".mygit/objects/" + dir + '/' + file;
-    ifstream inFile(objPath, ios::binary);
-    if (!inFile)
+    unsigned char checksum[SHA_DIGEST_LENGTH];
+    SHA1_Final(checksum, &shaContext);
+    string trailer(reinterpret_cast<const char *>(checksum), SHA_DIGEST_LENGTH);
+    if (::write(fd, trailer.data(), trailer.size()) != SHA_DIGEST_LENGTH)
+        failed = true;
+    close(fd);
+    if (failed)
     {
-        cerr << "Tree object not foundzzzzz" << tree_sha << "\n";
+        cerr << "ERR: Failed to write pack\n";
+        unlink(tempPack.c_str());
         return 1;
     }
 
-    stringstream buffer;
-    buffer << inFile.rdbuf();
-    string compressedData = buffer.str();
-
-    string treeData = decompressData(compressedData);
-    cout << "treedata " << treeData << '\n';
-    if (treeData.empty())
+    string idxData = PACK_IDX_SIGNATURE;
+    putBigEndian(idxData, PACK_IDX_VERSION, 4);
+    vector<uint32_t> fanout(256, 0);
+    for (const ObjectId &sha : ids)
+        fanout[sha.hash[0]]++;
+    uint32_t cumulative = 0;
+    for (uint32_t count : fanout)
     {
-        cerr << "ERR: Failed to decompress tree object\n";
+        cumulative += count;
+        putBigEndian(idxData, cumulative, 4);
+    }
+    for (const ObjectId &sha : ids)
+        idxData.append(reinterpret_cast<const char *>(sha.hash), SHA_DIGEST_LENGTH);
+    for (const ObjectId &sha : ids)
+        putBigEndian(idxData, offsets[sha], 8);
+    idxData += trailer;
+
+    string packName = ".mygit/objects/pack/pack-" + ObjectId::fromRaw(checksum).toHex();
+    string tempIdx = packName + ".idx.tmp";
+    ofstream idxFile(tempIdx, ios::binary | ios::trunc);
+    idxFile.write(idxData.data(), idxData.size());
+    idxFile.close();
+    // The idx goes in last: a pack is only visible once its idx exists
+    if (!idxFile || rename(tempPack.c_str(), (packName + ".pack").c_str()) != 0 ||
+        rename(tempIdx.c_str(), (packName + ".idx").c_str()) != 0)
+    {
+        cerr << "ERR: Failed to write pack index\n";
+        unlink(tempPack.c_str());
+        unlink(tempIdx.c_str());
         return 1;
     }
 
-    vector<TreeEntry> entries = parseTreeData(treeData);
-    if (entries.empty())
+    for (const Pack &pack : loadedPacks())
     {
-        return 1;
+        if (pack.packPath == packName + ".pack")
+            continue;
+        remove(pack.packPath, ec);
+        remove(path(pack.packPath).replace_extension(".idx"), ec);
+    }
+    for (const ObjectId &sha : ids)
+    {
+        path loose = objectPath(sha);
+        remove(loose, ec);
+        remove(loose.parent_path(), ec);
     }
-    displayTree(entries, nameonly);
 
+    cout << "Packed " << ids.size() << " objects (" << deltaCount << " deltas) into " << packName << ".pack\n";
     return 0;
 }
 
-void processFile(path &filepath, unordered_map<string, Metadata> &indexmap)
+// What fsck learned from one stored copy of an object
+struct FsckResult
 {
-    string sha = hashObject(filepath, false);
-    indexmap[filepath.string()] = {sha, "blob"};
-}
+    ObjectId id;
+    // the loose file or pack the copy was read from
+    string where;
+    string type;
+    // empty when the copy is sound
+    string error;
+    string warning;
+    // objects this one refers to, with the type each of them must have
+    vector<pair<ObjectId, const char *>> links;
+};
 
-void processDirectory(path &dirpath, unordered_map<string, Metadata> &indexmap)
+// Checks the "mode name\0<hex id>" entries of a tree. Unlike TreeView this
+// does not stop quietly at the first bad entry.
+string checkTree(string_view entries, FsckResult &result)
 {
-    string sha = writeTree(dirpath);
-    indexmap[dirpath.string()] = {sha, "blob"};
+    unordered_set<string_view> names;
+    string_view previous;
+    bool previousIsTree = false;
+    const char *pos = entries.data();
+    const char *end = pos + entries.size();
+    while (pos < end)
+    {
+        const char *space = static_cast<const char *>(memchr(pos, ' ', end - pos));
+        const char *nul = space ? static_cast<const char *>(memchr(space + 1, '\0', end - space - 1)) : nullptr;
+        ObjectId id;
+        if (!nul || end - nul - 1 < 2 * SHA_DIGEST_LENGTH ||
+            !ObjectId::fromHex(string_view(nul + 1, 2 * SHA_DIGEST_LENGTH), id))
+            return "malformed entry";
+
+        TreeMode mode = parseTreeMode(string_view(pos, space - pos));
+        string_view name(space + 1, nul - space - 1);
+        if (mode == MODE_UNKNOWN)
+            return "bad mode for " + string(name);
+        if (name.empty() || name == "." || name == ".." || name.find('/') != string_view::npos)
+            return "bad entry name '" + string(name) + "'";
+        if (!names.insert(name).second)
+            return "duplicate entry " + string(name);
+        // Trees written before entries were sorted are still readable
+        if (!previous.empty() && compareTreeNames(previous, previousIsTree, name, mode == MODE_TREE) > 0)
+            result.warning = "entries not sorted";
+
+        result.links.emplace_back(id, mode == MODE_TREE ? "tree" : "blob");
+        previous = name;
+        previousIsTree = mode == MODE_TREE;
+        pos = nul + 1 + 2 * SHA_DIGEST_LENGTH;
+    }
+    return "";
 }
 
-void detecteDeletions(unordered_map<string, Metadata> &indexMap)
+// Checks the name, email, tree, parents, timestamp and message fields of a commit
+string checkCommit(const string &content, FsckResult &result)
 {
-    for (auto it = indexMap.begin(); it != indexMap.end();)
+    vector<string_view> fields;
+    size_t start = 0;
+    for (int i = 0; i < 5; i++)
     {
-        path path(it->first);
-        if (!exists(path))
-        {
-            // cout << "Removing deleted file from index: " << path << "\n";
-            it = indexMap.erase(it);
-        }
-        else
-        {
-            ++it;
-        }
+        size_t nul = content.find('\0', start);
+        if (nul == string::npos)
+            return "missing fields";
+        fields.emplace_back(content.data() + start, nul - start);
+        start = nul + 1;
     }
-}
 
-void saveIndex(const unordered_map<string, Metadata> &indexMap)
-{
-    ofstream indexFile(".mygit/index", ios::trunc);
-    for (const auto &[path, entry] : indexMap)
+    ObjectId tree;
+    if (!ObjectId::fromHex(fields[2], tree))
+        return "bad tree id";
+    result.links.emplace_back(tree, "tree");
+
+    istringstream parents{string(fields[3])};
+    string parent;
+    ObjectId parentId;
+    while (parents >> parent)
     {
-        indexFile << entry.filemod << " " << entry.sha << " " << path << "\n";
+        if (!ObjectId::fromHex(parent, parentId))
+            return "bad parent id " + parent;
+        result.links.emplace_back(parentId, "commit");
     }
+    if (parseTimestamp(string(fields[4])) == 0)
+        return "bad timestamp";
+    return "";
 }
 
-void add(vector<string> &files)
+// Rehashes one stored copy of an object, a loose file or the entry at offset
+// in pack, by streaming it through SHA-1 in fixed-size chunks. Only trees and
+// commits are kept in memory for their structure checks; deltas are the one
+// exception, ObjectReader rebuilds them whole.
+FsckResult fsckObject(const ObjectId &id, const Pack *pack, uint64_t offset)
 {
-    unordered_map<string, Metadata> indexEntries;
-    ifstream indexFile(".mygit/index");
-    string line;
-    while (getline(indexFile, line))
+    FsckResult result;
+    result.id = id;
+    result.where = pack ? pack->packPath : objectPath(id);
+    ObjectReader reader;
+    if (!(pack ? reader.openPackEntry(*pack, offset) : reader.openLooseCopy(id)))
     {
-        istringstream ss(line);
-        string sha, filemode, filepath;
-        ss >> filemode >> sha >> filepath;
-        indexEntries[filepath] = {sha, filemode};
+        result.error = "cannot read object header";
+        return result;
     }
-    indexFile.close();
-
-    for (const auto &file : files)
+    result.type = reader.type;
+    if (packTypeCode(reader.type) == OBJ_NONE)
     {
-        path filepath(file);
-        if (exists(filepath))
-        {
-            if (is_directory(filepath))
-            {
-                if (filepath.filename() == ".mygit")
-                    continue;
-                processDirectory(filepath, indexEntries);
-            }
-            else if (is_regular_file(filepath))
-            {
-                processFile(filepath, indexEntries);
-            }
-        }
-        else
-        {
-            // TODO: raise as errror
-            cerr << "ERR: File not found " << file << '\n';
-            continue;
-        }
+        result.error = "unknown type '" + reader.type + "'";
+        return result;
     }
 
-    detecteDeletions(indexEntries);
-    saveIndex(indexEntries);
+    bool structured = reader.type == "tree" || reader.type == "commit";
+    string content;
+    ObjectWriter hasher(reader.type, reader.size, false);
+    char buffer[BUFFER_SIZE];
+    ssize_t bytesRead;
+    while ((bytesRead = reader.read(buffer, BUFFER_SIZE)) > 0)
+    {
+        hasher.write(buffer, bytesRead);
+        if (structured)
+            content.append(buffer, bytesRead);
+    }
+    if (bytesRead < 0)
+        result.error = "corrupt content";
+    else if (hasher.finish() != id)
+        result.error = "hash mismatch";
+    else if (reader.type == "tree")
+        result.error = checkTree(content, result);
+    else if (reader.type == "commit")
+        result.error = checkCommit(content, result);
+    return result;
+}
 
-    ofstream indexFileOut(".mygit/index", ios::trunc);
-    for (const auto &[filepath, Metadata] : indexEntries)
+// Checks that the ids of a pack index are sorted and consistent with its
+// fanout. loadedPacks() has already checked the sizes and offsets.
+string checkPackIndex(const Pack &pack)
+{
+    for (uint32_t i = 0; i < pack.count; i++)
     {
-        indexFileOut << Metadata.filemod << " " << Metadata.sha << " " << filepath << '\n';
+        ObjectId id = pack.idAt(i);
+        uint32_t first = id.hash[0] == 0 ? 0 : getBigEndian(pack.idx + 8 + (id.hash[0] - 1) * 4, 4);
+        if ((i > 0 && !(pack.idAt(i - 1) < id)) || i < first || i >= getBigEndian(pack.idx + 8 + id.hash[0] * 4, 4))
+            return "index ids are not sorted";
     }
+    return "";
+}
+
+// The pack trailer must hash the whole pack, the index must end with the same
+// trailer, and the pack must be named after it
+string checkPackChecksum(const Pack &pack)
+{
+    const char *trailer = pack.data + pack.dataSize - SHA_DIGEST_LENGTH;
+    if (!hasValidChecksum(pack.data, pack.dataSize))
+        return "pack checksum mismatch";
+    if (memcmp(pack.idx + pack.idxSize - SHA_DIGEST_LENGTH, trailer, SHA_DIGEST_LENGTH) != 0)
+        return "index checksum does not match the pack";
+    if (path(pack.packPath).filename() != "pack-" + ObjectId::fromRaw(trailer).toHex() + ".pack")
+        return "pack name does not match its checksum";
+    return "";
+}
 
-    indexFileOut.close();
+// Checks the signature and trailing SHA-1 of a file. A missing file is fine.
+string checkFileChecksum(const string &filepath, const char *signature)
+{
+    size_t size;
+    const char *data = mapFile(filepath, size);
+    if (!data)
+        return "";
+    string error;
+    if (size < 4 || memcmp(data, signature, 4) != 0)
+        error = "bad signature";
+    else if (!hasValidChecksum(data, size))
+        error = "checksum mismatch";
+    munmap(const_cast<char *>(data), size);
+    return error;
 }
 
-unordered_map<string, string> updateTree(unordered_map<string, TreeEntry> &entries)
+// Verifies every loose and packed object and the repository's checksummed
+// files, then checks that everything reachable from the branches, HEAD,
+// MERGE_HEAD and the index is present with the right type. Objects are
+// rehashed on the pool with a bounded number in flight. Unreachable objects
+// that nothing else refers to are listed as dangling.
+int fsck()
 {
-    // name:data
-    unordered_map<string, string> updated_treedata;
-    for (auto &[name, entry] : entries)
+    ThreadPool &pool = workPool();
+    size_t window = 4 * max(jobs, 1u);
+    size_t errors = 0, checked = 0;
+
+    struct FsckObject
     {
-        path filepath(name);
-        if (exists(filepath))
+        string type;
+        vector<pair<ObjectId, const char *>> links;
+        bool reachable = false;
+        bool referenced = false;
+    };
+    unordered_map<ObjectId, FsckObject, ObjectIdHash> objects;
+    // ids with a copy that failed verification, already reported
+    unordered_set<ObjectId, ObjectIdHash> broken;
+
+    deque<future<FsckResult>> inFlight;
+    auto collectOldest = [&]()
+    {
+        FsckResult result = pool.wait(inFlight.front());
+        inFlight.pop_front();
+        checked++;
+        if (!result.warning.empty())
+            cerr << "warning: " << result.type << ' ' << result.id << ": " << result.warning << '\n';
+        if (!result.error.empty())
         {
-            string entryData = entry.filemod + " " + entry.filename + '\0' + entry.filehash;
-            updated_treedata[entry.filename] = entryData;
+            cerr << "ERR: " << (result.type.empty() ? "object" : result.type) << ' ' << result.id << " in "
+                 << result.where << ": " << result.error << '\n';
+            broken.insert(result.id);
+            errors++;
+            return;
         }
-    }
-
-    ifstream indexFile(".mygit/index");
-    if (!indexFile)
+        FsckObject &object = objects[result.id];
+        object.type = result.type;
+        object.links = move(result.links);
+    };
+    auto check = [&](const ObjectId &id, const Pack *pack, uint64_t offset)
     {
-        cerr << "ERR: Index file does not exist\n";
-        return {};
-    }
-    string line;
-    while (getline(indexFile, line))
+        if (inFlight.size() >= window)
+            collectOldest();
+        inFlight.push_back(pool.submit([id, pack, offset]
+                                       { return fsckObject(id, pack, offset); }));
+    };
+
+    // loadedPacks() reports and skips the packs whose layout is broken
+    error_code ec;
+    size_t packFiles = 0;
+    for (auto &entry : directory_iterator(".mygit/objects/pack", ec))
+        packFiles += entry.path().extension() == ".idx";
+    errors += packFiles - loadedPacks().size();
+
+    vector<pair<string, future<string>>> checksums;
+    for (const Pack &pack : loadedPacks())
     {
-        istringstream lineStream(line);
-        string name, type, sha;
-
-        lineStream >> type >> sha >> name;
-
-        if (type == "blob")
+        string error = checkPackIndex(pack);
+        if (!error.empty())
         {
-            string entryData = "100644 " + name + '\0' + sha;
-            updated_treedata[name] = entryData;
+            cerr << "ERR: " << pack.packPath << ": " << error << '\n';
+            errors++;
+            continue;
         }
-        else if (type == "tree")
+        const Pack *packed = &pack;
+        checksums.emplace_back(pack.packPath, pool.submit([packed]
+                                                          { return checkPackChecksum(*packed); }));
+        for (uint32_t i = 0; i < pack.count; i++)
+            check(pack.idAt(i), packed, pack.offsetAt(i));
+    }
+
+    ObjectId id;
+    for (auto &dir : directory_iterator(".mygit/objects", ec))
+    {
+        string prefix = dir.path().filename().string();
+        if (prefix.size() != 2 || !dir.is_directory())
+            continue;
+        for (auto &file : directory_iterator(dir.path(), ec))
         {
-            string entryData = "040000 " + name + '\0' + sha;
-            updated_treedata[name] = entryData;
+            if (ObjectId::fromHex(prefix + file.path().filename().string(), id))
+                check(id, nullptr, 0);
         }
     }
+    while (!inFlight.empty())
+        collectOldest();
 
-    indexFile.close();
-    return updated_treedata;
-}
-
-// string getCurrentTimestamp()
-// {
-//     time_t t = time(nullptr);
-//     char buf[100];
-//     strftime(buf, sizeof(buf), "%Y-%m-%d %H:%M:%S", localtime(&t));
-//     return buf;
-// }
-
-string getCurrentTimestamp()
-{
-    time_t t = time(nullptr);
-    struct tm *localTime = localtime(&t);
-
-    char buf[100];
-    strftime(buf, sizeof(buf), "%a %b %d %H:%M:%S %Y", localTime);
-
-    // Get the timezone offset in hours and minutes
-    int offset = static_cast<int>(localTime->tm_gmtoff / 60);
-    char timezone[6];
-    snprintf(timezone, sizeof(timezone), "%+03d%02d", offset / 60, abs(offset % 60));
-
-    ostringstream oss;
-    oss << buf << " " << timezone;
-    return oss.str();
-}
-
-string commit(string &message)
-{
-    ifstream headFile(".mygit/HEAD");
-    string branchRef;
-    if (!headFile)
+    for (auto &[packPath, result] : checksums)
     {
-        branchRef = "refs/heads/main";
-        ofstream headInit(".mygit/HEAD");
-        headInit << "ref: " << branchRef;
-        headInit.close();
+        string error = pool.wait(result);
+        if (!error.empty())
+        {
+            cerr << "ERR: " << packPath << ": " << error << '\n';
+            errors++;
+        }
     }
-    else
+    string graphError = checkFileChecksum(".mygit/objects/info/commit-graph", GRAPH_SIGNATURE);
+    if (!graphError.empty())
     {
-        getline(headFile, branchRef);
-        branchRef = branchRef.substr(5);
+        cerr << "ERR: .mygit/objects/info/commit-graph: " << graphError << '\n';
+        errors++;
     }
-    headFile.close();
-    bool isFirstCommit = !exists(".mygit/" + branchRef);
-    string treesha, parentSHA;
-    if (isFirstCommit)
+
+    // (object, type it must have, object that refers to it or the null id)
+    vector<tuple<ObjectId, const char *, ObjectId>> pending;
+    for (const ObjectId &tip : refTips())
+        pending.emplace_back(tip, "commit", ObjectId());
+    ifstream mergeFile(MERGE_HEAD);
+    string mergeLine;
+    getline(mergeFile, mergeLine);
+    if (ObjectId::fromHex(mergeLine, id))
+        pending.emplace_back(id, "commit", ObjectId());
+    // load() verifies the index checksum itself
+    Index index;
+    if (!index.load())
+        errors++;
+    for (const Metadata &entry : index.entries)
     {
-        // todo: avoid unstaged files
-        treesha = writeTree(current_path());
-        create_directories(".mygit/refs/heads");
+        if (!entry.removed)
+            pending.emplace_back(entry.sha, "blob", ObjectId());
     }
-    else
+    for (const auto &[dir, node] : index.cacheTree)
+        pending.emplace_back(node.id, "tree", ObjectId());
+
+    while (!pending.empty())
     {
-        ifstream branchFile(".mygit/" + branchRef);
-        getline(branchFile, parentSHA);
-        string commit_data = getObjData(parentSHA);
-        // cout << "parent commit data " << commit_data << '\n';
-        string parenttree = extractTreeSHA(commit_data);
-        unordered_map<string, TreeEntry> entries = getTreeData(parenttree);
-        for (auto &[name, detail] : entries)
+        auto [sha, expected, from] = pending.back();
+        pending.pop_back();
+        auto it = objects.find(sha);
+        if (it == objects.end())
         {
-            cout << "name: " << name << "  " << detail.filehash << "\n";
+            if (broken.insert(sha).second)
+            {
+                cerr << "ERR: missing " << expected << ' ' << sha;
+                if (!from.isNull())
+                    cerr << " referenced by " << from;
+                cerr << '\n';
+                errors++;
+            }
+            continue;
         }
-        unordered_map<string, string> updatedTreeData = updateTree(entries);
-        for (auto &[name, detail] : updatedTreeData)
+        FsckObject &object = it->second;
+        if (object.type != expected)
         {
-            cout << "name: " << name << "  " << detail << "\n";
+            cerr << "ERR: " << sha << " is a " << object.type << ", expected a " << expected;
+            if (!from.isNull())
+                cerr << " in " << from;
+            cerr << '\n';
+            errors++;
         }
+        if (object.reachable)
+            continue;
+        object.reachable = true;
+        for (const auto &[link, linkType] : object.links)
+            pending.emplace_back(link, linkType, sha);
+    }
 
-        string treeData;
-        for (auto &[file, entrydata] : updatedTreeData)
+    for (const auto &[sha, object] : objects)
+    {
+        for (const auto &link : object.links)
         {
-            treeData += entrydata;
+            auto it = objects.find(link.first);
+            if (it != objects.end())
+                it->second.referenced = true;
         }
-
-        writeObject(treeData, "tree");
-        treesha = hashBlob(treeData);
     }
-    string timestamp = getCurrentTimestamp();
-    string commitData = user.name + '\0' +
-                        user.email + '\0' + treesha + '\0' +
-                        parentSHA + '\0' +
-                        timestamp + '\0' +
-                        message;
-
-    writeObject(commitData, "commit");
-    string commitSha = hashBlob(commitData);
-    ofstream refFile(".mygit/" + branchRef, ios::trunc);
-    refFile << commitSha;
-    refFile.close();
-    return commitSha;
-}
-
-string extractlog(string &commitData, string &commitsha)
-{
-
-    istringstream ss(commitData);
-    string header;
-    getline(ss, header, '\0');
-    string type;
-    stringstream strstr(header);
-    strstr >> type;
-    if (type != "commit")
+    vector<pair<ObjectId, string>> dangling;
+    for (const auto &[sha, object] : objects)
     {
-        cout << "Not a commit object\n";
-        return "";
+        if (!object.reachable && !object.referenced)
+            dangling.emplace_back(sha, object.type);
     }
+    sort(dangling.begin(), dangling.end());
+    for (const auto &[sha, type] : dangling)
+        cout << "dangling " << type << ' ' << sha << '\n';
 
-    string userName, userEmail, treeSHA, parentsha;
-    string timestamp, message;
-    getline(ss, userName, '\0');
-    getline(ss, userEmail, '\0');
-    getline(ss, treeSHA, '\0');
-    getline(ss, parentsha, '\0');
-    getline(ss, timestamp, '\0');
-    getline(ss, message, '\0');
-    cout << "commit " << commitsha << '\n';
-    cout << "Author: " << userName << " " << "<" << userEmail << ">\n";
-    cout << "Date:   " << timestamp << '\n';
-    cout << "parentsha: " << parentsha << '\n';
-
-    cout << "\t" << message << "\n\n";
-    return parentsha;
+    cout << "Checked " << checked << " objects, " << errors << (errors == 1 ? " error\n" : " errors\n");
+    return errors ? 1 : 0;
 }
 
-void displaycommit(string &commitsha)
+// Strips "-j N" / "-jN" and "--debug" given before the command and records
+// them. Arguments from the command on are kept as they are.
+void parseOptions(int &argc, char *argv[])
 {
-    string parentsha = commitsha;
-    do
+    int first = 1;
+    while (first < argc)
     {
-        string commitData = getObjData(parentsha);
-        // cout << "Data: " << commitData;
-        parentsha = extractlog(commitData, parentsha);
-    } while (!parentsha.empty());
-}
-void checkout(string &commitsha)
-{
-    string commitData = getObjData(commitsha);
-    cout << "Data: " << commitData << '\n';
+        if (strcmp(argv[first], "--debug") == 0)
+            debugTrace = true;
+        else if (strcmp(argv[first], "-j") == 0 && first + 1 < argc)
+            jobs = strtoul(argv[++first], nullptr, 10);
+        else if (strncmp(argv[first], "-j", 2) == 0 && isdigit(argv[first][2]))
+            jobs = strtoul(argv[first] + 2, nullptr, 10);
+        else
+            break;
+        first++;
+    }
+
+    int kept = 1;
+    for (int i = first; i < argc; i++)
+        argv[kept++] = argv[i];
+    argv[kept] = nullptr;
+    argc = kept;
 }
 
 int main(int argc, char *argv[])
 {
+    parseOptions(argc, argv);
     if (argc == 1)
     {
         cout << "ERR: Too few arguments\n";
@@ -962,20 +7001,48 @@ int main(int argc, char *argv[])
             return 1;
         }
         bool create_blob = false;
-        string filepath;
-        if (strcmp(argv[2], "-w") == 0)
+        string filepath, mode;
+        for (int i = 2; i < argc; i++)
         {
-            create_blob = true;
-            filepath = argv[3];
+            if (strcmp(argv[i], "-w") == 0)
+                create_blob = true;
+            else if (strcmp(argv[i], "--stdin-paths") == 0 || strcmp(argv[i], "--stdin") == 0)
+                mode = argv[i];
+            else
+                filepath = argv[i];
         }
-        else
+
+        if (mode == "--stdin-paths")
+            return hashStdinPaths(create_blob);
+        if (mode == "--stdin")
+        {
+            stringstream content;
+            content << cin.rdbuf();
+            string data = content.str();
+            ObjectId sha = storeObject("blob", data.data(), data.size(), create_blob);
+            if (sha.isNull())
+                return 1;
+            cout << sha << '\n';
+            return 0;
+        }
+        if (filepath.empty())
         {
-            filepath = argv[2];
+            cerr << "ERR: Too few arguments\n";
+            return 1;
         }
         hashObject(filepath, create_blob, true);
     }
     else if (command == "cat-file")
     {
+        if (argc == 3 && (strcmp(argv[2], "--batch") == 0 || strcmp(argv[2], "--batch-check") == 0))
+        {
+            return catFileBatch(strcmp(argv[2], "--batch-check") == 0);
+        }
+        if (argc < 4)
+        {
+            cerr << "ERR: Too few arguments\n";
+            return 1;
+        }
         string flag = argv[2];
         string fileSha = argv[3];
         catFile(flag, fileSha);
@@ -1015,7 +7082,13 @@ int main(int argc, char *argv[])
         {
             tree_sha = argv[2];
         }
-        lstree(tree_sha, nameonly);
+        ObjectId treeId;
+        if (!ObjectId::fromHex(tree_sha, treeId))
+        {
+            cerr << "ERR: Invalid object id " << tree_sha << '\n';
+            return 1;
+        }
+        lstree(treeId, nameonly);
     }
     // todo: arg coubt
     else if (command == "add")
@@ -1025,8 +7098,7 @@ int main(int argc, char *argv[])
         {
             files.push_back(argv[i]);
         }
-        add(files);
-        // todo: arg coubt
+        return add(files);
     }
     else if (command == "commit")
     {
@@ -1035,37 +7107,43 @@ int main(int argc, char *argv[])
         {
             message = argv[3];
         }
-        string sha = commit(message);
+        ObjectId sha = commit(message);
+        if (sha.isNull())
+            return 1;
         cout << sha << '\n';
     }
     else if (command == "log")
     {
-        if (argc > 2)
+        string filepath;
+        bool stat = false;
+        int arg = 2;
+        if (arg < argc && strcmp(argv[arg], "--stat") == 0)
+        {
+            stat = true;
+            arg++;
+        }
+        if (argc == arg + 2 && strcmp(argv[arg], "--") == 0)
+        {
+            filepath = indexPath(argv[arg + 1]);
+        }
+        else if (argc > arg)
         {
             cout << "ERR: Too many arguments\n";
             return 1;
         }
 
-        ifstream headFile(".mygit/HEAD");
-        string branchRef;
-        if (!headFile)
+        if (!exists(".mygit/HEAD"))
         {
             cerr << "ERR: HEAD file not found\n";
             return 1;
         }
-        getline(headFile, branchRef);
-        branchRef = branchRef.substr(5);
-        headFile.close();
-
-        ifstream branchFile(".mygit/" + branchRef);
-        string latestCommit;
-        getline(branchFile, latestCommit);
-        if (latestCommit == "")
+        ObjectId latestCommit = readHead();
+        if (latestCommit.isNull())
         {
             cout << "No commits till now\n";
             return 0;
         }
-        displaycommit(latestCommit);
+        displaycommit(latestCommit, filepath, stat);
     }
     else if (command == "checkout")
     {
@@ -1079,8 +7157,126 @@ int main(int argc, char *argv[])
             cout << "ERR: Too few arguments\n";
             return 1;
         }
-        string commitsha = argv[2];
-        checkout(commitsha);
+        return checkout(argv[2]);
+    }
+    else if (command == "diff")
+    {
+        if (argc != 4)
+        {
+            cerr << "ERR: Usage: diff <blob|tree-ish> <blob|tree-ish>\n";
+            return 1;
+        }
+        return diff(argv[2], argv[3]);
+    }
+    else if (command == "diff-tree")
+    {
+        bool renames = argc == 5 && strcmp(argv[2], "-M") == 0;
+        if (argc != 4 + renames)
+        {
+            cerr << "ERR: Usage: diff-tree [-M] <tree-ish> <tree-ish>\n";
+            return 1;
+        }
+        return diffTree(argv[2 + renames], argv[3 + renames], renames);
+    }
+    else if (command == "branch")
+    {
+        if (argc > 3)
+        {
+            cout << "ERR: Too many arguments\n";
+            return 1;
+        }
+        return branch(argc == 3 ? argv[2] : "");
+    }
+    else if (command == "merge")
+    {
+        if (argc != 3)
+        {
+            cerr << "ERR: Usage: merge <branch>\n";
+            return 1;
+        }
+        return merge(argv[2]);
+    }
+    else if (command == "status")
+    {
+        if (argc > 2)
+        {
+            cout << "ERR: Too many arguments\n";
+            return 1;
+        }
+        return status();
+    }
+    else if (command == "fsmonitor")
+    {
+        if (argc != 3)
+        {
+            cerr << "ERR: Usage: fsmonitor start|stop|run\n";
+            return 1;
+        }
+        return fsmonitor(argv[2]);
+    }
+    else if (command == "repack")
+    {
+        if (argc > 2)
+        {
+            cout << "ERR: Too many arguments\n";
+            return 1;
+        }
+        // The graph is written first: the packs this process has mapped are
+        // the ones repack is about to replace. Packing does not need it, so a
+        // failure only costs the next walk its speed.
+        if (writeCommitGraph() != 0)
+            cerr << "warning: Commit-graph not written, repacking anyway\n";
+        return repack();
+    }
+    else if (command == "fsck")
+    {
+        if (argc > 2)
+        {
+            cout << "ERR: Too many arguments\n";
+            return 1;
+        }
+        return fsck();
+    }
+    else if (command == "commit-graph")
+    {
+        if (argc != 3 || strcmp(argv[2], "write") != 0)
+        {
+            cerr << "ERR: Usage: commit-graph write\n";
+            return 1;
+        }
+        return writeCommitGraph();
+    }
+    else if (command == "rev-list")
+    {
+        bool countOnly = false;
+        ObjectId start;
+        for (int i = 2; i < argc; i++)
+        {
+            if (strcmp(argv[i], "--count") == 0)
+                countOnly = true;
+            else if (!ObjectId::fromHex(argv[i], start))
+            {
+                cerr << "ERR: Invalid object id " << argv[i] << '\n';
+                return 1;
+            }
+        }
+        if (start.isNull())
+            start = readHead();
+        if (start.isNull())
+        {
+            cout << "No commits till now\n";
+            return 0;
+        }
+
+        size_t count = 0;
+        walkHistory(start, [&](const ObjectId &sha, const CommitInfo &)
+                    {
+            if (!countOnly)
+                cout << sha << '\n';
+            count++;
+            return true; });
+        if (countOnly)
+            cout << count << '\n';
     }
     else
     {